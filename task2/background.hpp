@@ -0,0 +1,87 @@
+#pragma once
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <stdexcept>
+#include <omp.h>
+
+
+// Одна фоновая нить, выполняющая задачи по очереди. Параллельные регионы OpenMP внутри задач
+// получают omp_threads нитей — это доля машины, отданная фоновой работе.
+// submit ждёт, только если в очереди уже max_pending задач: память под снимки не растёт без предела.
+// Деструктор дожидается всех задач
+class BackgroundWorker {
+public:
+    BackgroundWorker(int omp_threads, size_t max_pending = 4)
+        : omp_threads(omp_threads), max_pending(max_pending), busy(false), stop(false),
+          thread([this] { run(); }) {}
+
+    ~BackgroundWorker() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        changed.notify_all();
+        thread.join();
+    }
+
+    BackgroundWorker(const BackgroundWorker&) = delete;
+    BackgroundWorker& operator=(const BackgroundWorker&) = delete;
+
+    void submit(std::function<void()> task) {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&] { return tasks.size() < max_pending; });
+        tasks.push_back(std::move(task));
+        lock.unlock();
+        changed.notify_all();
+    }
+
+    // Дождаться, пока очередь опустеет и текущая задача закончится
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&] { return tasks.empty() && !busy; });
+    }
+
+private:
+    int omp_threads;
+    size_t max_pending;
+    bool busy, stop;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::thread thread;
+
+    void run() {
+        omp_set_num_threads(omp_threads);
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&] { return stop || !tasks.empty(); });
+                if (tasks.empty()) {
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop_front();
+                busy = true;
+            }
+            changed.notify_all();
+
+            // Ошибка фоновой задачи (например, не удалось записать чекпоинт) не должна ронять обучение
+            try {
+                task();
+            } catch (const std::exception& e) {
+                std::cerr << "Ошибка фоновой задачи: " << e.what() << std::endl;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                busy = false;
+            }
+            changed.notify_all();
+        }
+    }
+};
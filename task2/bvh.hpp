@@ -0,0 +1,236 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <numeric>
+#include <limits>
+
+
+// Число корзин по каждой оси при поиске разбиения по SAH
+const int BVH_BINS = 16;
+// Лист не больше этого числа примитивов (если только их не нельзя разделить),
+// но не меньше двух векторов ядра, которое обрабатывает листья
+const uint32_t BVH_MAX_LEAF = 8;
+// Глубже дерево не строится, чтобы стек обхода был фиксированного размера
+const int BVH_MAX_DEPTH = 60;
+
+
+// 32 байта, два узла в кэш-линии. Узлы лежат в порядке обхода в глубину:
+// левый потомок внутреннего узла идёт сразу за ним, индекс правого хранится в first.
+// У листа count > 0 и first — индекс первого примитива в переупорядоченном массиве
+struct BVHNode {
+    glm::vec3 lo;
+    uint32_t first;
+    glm::vec3 hi;
+    uint32_t count;
+};
+
+
+inline float boxDistance2(const BVHNode& node, const glm::vec3& p) {
+    glm::vec3 d = glm::max(glm::max(node.lo - p, p - node.hi), 0.0f);
+    return glm::dot(d, d);
+}
+
+
+// Иерархия ограничивающих объёмов над произвольными примитивами, заданными своими AABB.
+// Сами примитивы дерево не хранит: после build() вызывающий переставляет их в порядке order,
+// и тогда листья ссылаются на непрерывные диапазоны.
+// lanes — сколько примитивов лист проверяет за одну операцию: стоимость листа в SAH
+// считается по числу векторов, а не примитивов
+class BVH {
+public:
+    std::vector<BVHNode> nodes;
+    std::vector<uint32_t> order;
+
+    void build(const std::vector<glm::vec3>& lo, const std::vector<glm::vec3>& hi, uint32_t lanes = 1) {
+        this->lanes = lanes;
+        max_leaf = std::max(BVH_MAX_LEAF, 2 * lanes);
+        nodes.clear();
+        order.resize(lo.size());
+        std::iota(order.begin(), order.end(), 0);
+        if (lo.empty()) {
+            return;
+        }
+
+        centroids.resize(lo.size());
+        for (size_t i = 0; i < lo.size(); ++i) {
+            centroids[i] = (lo[i] + hi[i]) * 0.5f;
+        }
+        nodes.reserve(2 * lo.size() / max_leaf + 1);
+        buildNode(lo, hi, 0, lo.size(), 0);
+        centroids.clear();
+        centroids.shrink_to_fit();
+    }
+
+    bool empty() const {
+        return nodes.empty();
+    }
+
+    // Поиск ближайшего примитива к точке p. best2 — текущий квадрат расстояния до ближайшего,
+    // leaf(node, best2) перебирает примитивы листа nodes[node] и уменьшает best2.
+    // Узлы, коробка которых дальше best2, отбрасываются; ближний потомок обходится первым
+    template <class LeafFn>
+    void nearest(const glm::vec3& p, float& best2, LeafFn&& leaf) const {
+        if (nodes.empty()) {
+            return;
+        }
+
+        struct Entry { uint32_t node; float dist2; };
+        Entry stack[BVH_MAX_DEPTH + 4];
+        int sp = 0;
+        uint32_t node = 0;
+
+        while (true) {
+            const BVHNode& nd = nodes[node];
+            if (nd.count > 0) {
+                leaf(node, best2);
+            } else {
+                uint32_t a = node + 1, b = nd.first;
+                float da = boxDistance2(nodes[a], p), db = boxDistance2(nodes[b], p);
+                if (db < da) {
+                    std::swap(a, b);
+                    std::swap(da, db);
+                }
+                if (da < best2) {
+                    if (db < best2) {
+                        stack[sp++] = {b, db};
+                    }
+                    node = a;
+                    continue;
+                }
+            }
+
+            // Пока узел лежал в стеке, best2 мог уменьшиться
+            do {
+                if (sp == 0) {
+                    return;
+                }
+                --sp;
+            } while (stack[sp].dist2 >= best2);
+            node = stack[sp].node;
+        }
+    }
+
+private:
+    std::vector<glm::vec3> centroids;
+    uint32_t lanes = 1, max_leaf = BVH_MAX_LEAF;
+
+    float cost(uint32_t count) const {
+        return static_cast<float>((count + lanes - 1) / lanes);
+    }
+
+    static float area(const glm::vec3& lo, const glm::vec3& hi) {
+        glm::vec3 d = glm::max(hi - lo, 0.0f);
+        return d.x * d.y + d.y * d.z + d.z * d.x;
+    }
+
+    uint32_t buildNode(const std::vector<glm::vec3>& lo, const std::vector<glm::vec3>& hi,
+                       size_t begin, size_t end, int depth) {
+        uint32_t index = nodes.size();
+        nodes.push_back(BVHNode());
+
+        const float INF = std::numeric_limits<float>::max();
+        glm::vec3 boxLo(INF), boxHi(-INF), cLo(INF), cHi(-INF);
+        for (size_t i = begin; i < end; ++i) {
+            uint32_t t = order[i];
+            boxLo = glm::min(boxLo, lo[t]);
+            boxHi = glm::max(boxHi, hi[t]);
+            cLo = glm::min(cLo, centroids[t]);
+            cHi = glm::max(cHi, centroids[t]);
+        }
+        nodes[index].lo = boxLo;
+        nodes[index].hi = boxHi;
+
+        size_t count = end - begin;
+        if (count <= 2 || depth >= BVH_MAX_DEPTH) {
+            return makeLeaf(index, begin, count);
+        }
+
+        // Binned SAH: стоимость разбиения 1 + (A_L * C(N_L) + A_R * C(N_R)) / A против C(N) у листа
+        int bestAxis = -1, bestSplit = 0;
+        float bestCost = INF;
+        for (int axis = 0; axis < 3; ++axis) {
+            float extent = cHi[axis] - cLo[axis];
+            if (extent <= 0.0f) {
+                continue;
+            }
+            float k = BVH_BINS * (1.0f - 1e-6f) / extent;
+
+            glm::vec3 binLo[BVH_BINS], binHi[BVH_BINS];
+            uint32_t binCount[BVH_BINS] = {0};
+            for (int b = 0; b < BVH_BINS; ++b) {
+                binLo[b] = glm::vec3(INF);
+                binHi[b] = glm::vec3(-INF);
+            }
+            for (size_t i = begin; i < end; ++i) {
+                uint32_t t = order[i];
+                int b = static_cast<int>((centroids[t][axis] - cLo[axis]) * k);
+                binCount[b]++;
+                binLo[b] = glm::min(binLo[b], lo[t]);
+                binHi[b] = glm::max(binHi[b], hi[t]);
+            }
+
+            // Площади правых частей накапливаются справа налево, левых — в основном проходе
+            float rightArea[BVH_BINS];
+            uint32_t rightCount[BVH_BINS];
+            glm::vec3 accLo(INF), accHi(-INF);
+            uint32_t acc = 0;
+            for (int b = BVH_BINS - 1; b > 0; --b) {
+                accLo = glm::min(accLo, binLo[b]);
+                accHi = glm::max(accHi, binHi[b]);
+                acc += binCount[b];
+                rightArea[b] = area(accLo, accHi);
+                rightCount[b] = acc;
+            }
+            accLo = glm::vec3(INF);
+            accHi = glm::vec3(-INF);
+            acc = 0;
+            for (int b = 0; b < BVH_BINS - 1; ++b) {
+                accLo = glm::min(accLo, binLo[b]);
+                accHi = glm::max(accHi, binHi[b]);
+                acc += binCount[b];
+                if (acc == 0 || rightCount[b + 1] == 0) {
+                    continue;
+                }
+                float split = area(accLo, accHi) * cost(acc) + rightArea[b + 1] * cost(rightCount[b + 1]);
+                if (split < bestCost) {
+                    bestCost = split;
+                    bestAxis = axis;
+                    bestSplit = b + 1;
+                }
+            }
+        }
+
+        float boxArea = area(boxLo, boxHi);
+        float splitCost = boxArea > 0.0f ? 1.0f + bestCost / boxArea : INF;
+        if (count <= max_leaf && splitCost >= cost(count)) {
+            return makeLeaf(index, begin, count);
+        }
+
+        size_t mid;
+        if (bestAxis >= 0) {
+            float k = BVH_BINS * (1.0f - 1e-6f) / (cHi[bestAxis] - cLo[bestAxis]);
+            float base = cLo[bestAxis];
+            int axis = bestAxis, split = bestSplit;
+            mid = std::partition(order.begin() + begin, order.begin() + end, [&](uint32_t t) {
+                return static_cast<int>((centroids[t][axis] - base) * k) < split;
+            }) - order.begin();
+        } else {
+            // Все центры совпадают: делим пополам, чтобы листья не разрастались
+            mid = begin + count / 2;
+        }
+
+        buildNode(lo, hi, begin, mid, depth + 1);
+        uint32_t right = buildNode(lo, hi, mid, end, depth + 1);
+        nodes[index].first = right;
+        nodes[index].count = 0;
+        return index;
+    }
+
+    uint32_t makeLeaf(uint32_t index, size_t begin, size_t count) {
+        nodes[index].first = begin;
+        nodes[index].count = count;
+        return index;
+    }
+};
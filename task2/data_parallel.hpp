@@ -0,0 +1,81 @@
+#pragma once
+#include "network.hpp"
+#include <vector>
+
+
+// Обучение с параллелизмом по данным: батч делится на shards частей, каждую часть считает одна нить
+// со своей рабочей памятью и своим буфером градиентов (параметры сети общие и только читаются).
+// Внутри части операции не распараллеливаются, поэтому нет регионов на каждую операцию и нити
+// не ждут друг друга до конца шага. Затем градиенты частей сводятся (all-reduce в общей памяти):
+// буфер параметров режется на отрезки, и каждая нить суммирует свой отрезок по всем частям.
+// Части и порядок суммирования фиксированы, поэтому результат не зависит от числа нитей.
+// total_rows — размер всего батча, если batch_rows — только его часть (у процесса распределённого обучения)
+class DataParallel {
+public:
+    DataParallel(const SIREN& model, size_t batch_rows, int shards, size_t total_rows = 0)
+        : batch_rows(batch_rows), total_rows(total_rows ? total_rows : batch_rows), num_params(model.numParams()),
+          workspaces(std::max<size_t>(1, std::min<size_t>(shards, batch_rows))),
+          grads(workspaces.size()), losses(workspaces.size()) {
+        for (size_t s = 0; s < workspaces.size(); ++s) {
+            model.reserve(shardEnd(s) - shardBegin(s), workspaces[s]);
+            grads[s].resize(num_params);
+        }
+    }
+
+    int shards() const {
+        return workspaces.size();
+    }
+
+    // Микробатч x (batch_rows x inputWidth), y (batch_rows x outputWidth): части прибавляют свои градиенты
+    // к своим буферам. Возвращает MSE всего микробатча (вклад этих строк в MSE батча из total_rows)
+    float accumulate(const SIREN& model, const float* x, const float* y) {
+        size_t in = model.inputWidth(), out = model.outputWidth();
+        parallelFor(workspaces.size(), static_cast<int>(workspaces.size()), [&](size_t begin, size_t end, int) {
+            for (size_t s = begin; s < end; ++s) {
+                size_t row = shardBegin(s);
+                losses[s] = model.trainStep(x + row * in, y + row * out, shardEnd(s) - row, workspaces[s],
+                                            grads[s].data(), total_rows);
+            }
+        }, 1);
+
+        float loss = 0.0f;
+        for (float l : losses) {
+            loss += l;
+        }
+        return loss;
+    }
+
+    // Записывает сумму градиентов частей в буфер градиентов модели и обнуляет буферы частей
+    void reduce(SIREN& model) {
+        float* result = model.gradients();
+        parallelFor(num_params, REDUCE_POLICY, [&](size_t begin, size_t end, int) {
+            std::copy(grads[0].data() + begin, grads[0].data() + end, result + begin);
+            std::fill(grads[0].data() + begin, grads[0].data() + end, 0.0f);
+            for (size_t s = 1; s < grads.size(); ++s) {
+                float* g = grads[s].data();
+                #pragma omp simd
+                for (size_t i = begin; i < end; ++i) {
+                    result[i] += g[i];
+                    g[i] = 0.0f;
+                }
+            }
+        });
+    }
+
+private:
+    // Сложение нескольких буферов: на нить должно прийтись хотя бы несколько тысяч чисел
+    static constexpr ParallelPolicy REDUCE_POLICY = {8192, false};
+
+    size_t batch_rows, total_rows, num_params;
+    std::vector<InferenceWorkspace> workspaces;
+    std::vector<AlignedBuffer> grads;
+    std::vector<float> losses;
+
+    size_t shardBegin(size_t s) const {
+        return batch_rows * s / workspaces.size();
+    }
+
+    size_t shardEnd(size_t s) const {
+        return batch_rows * (s + 1) / workspaces.size();
+    }
+};
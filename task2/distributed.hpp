@@ -0,0 +1,431 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <iostream>
+#include <cstdio>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <csignal>
+#include <cerrno>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+// Сколько процесс ждёт остальных (подключения или очередного шага), прежде чем считать, что они упали
+const int DISTRIBUTED_TIMEOUT_SECONDS = 300;
+
+
+// Сумма буферов float по всем процессам одного обучения (world процессов, у каждого свой rank).
+// Слагаемые складываются по порядку rank, поэтому результат у всех процессов одинаков бит в бит
+// и совпадает с суммой частей DataParallel в одном процессе. capacity — наибольший count для sum
+class AllReduce {
+public:
+    virtual ~AllReduce() {}
+
+    // data (count <= capacity чисел) заменяется суммой data всех процессов
+    virtual void sum(float* data, size_t count) = 0;
+
+    // Дождаться, пока все процессы дойдут до этой точки
+    virtual void barrier() = 0;
+
+    // Сколько sum и barrier ждут остальных процессов; 0 — без ограничения. Упавший процесс
+    // обнаруживается и без тайм-аута: shm проверяет, живы ли процессы, у сокета обрывается соединение
+    virtual void setTimeout(int seconds) { timeout_seconds = seconds; }
+
+    int rank() const { return my_rank; }
+    int size() const { return world; }
+
+protected:
+    AllReduce(int rank, int world) : my_rank(rank), world(world) {}
+
+    int my_rank, world;
+    int timeout_seconds = DISTRIBUTED_TIMEOUT_SECONDS;
+
+    static double secondsSince(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+};
+
+
+// Через общую память POSIX (shm_open). В сегменте ячейка на каждый процесс и буфер результата.
+// sum: процесс копирует данные в свою ячейку, после барьера суммирует по всем ячейкам свой отрезок
+// результата (каждый по 1/world буфера), после второго барьера копирует весь результат к себе.
+// Rank 0 создаёт сегмент и удаляет его имя, когда все подключились: после выхода ничего не остаётся
+class ShmAllReduce : public AllReduce {
+public:
+    ShmAllReduce(const std::string& name, int rank, int world, size_t capacity)
+        : AllReduce(rank, world), name("/" + name), capacity(capacity), local_sense(0) {
+        size_t pid_bytes = (world * sizeof(pid_t) + 63) / 64 * 64;
+        size_t bytes = sizeof(Header) + pid_bytes + (world + 1) * capacity * sizeof(float);
+        auto start = std::chrono::steady_clock::now();
+        int fd = -1;
+        if (rank == 0) {
+            ::shm_unlink(this->name.c_str());
+            fd = ::shm_open(this->name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+            if (fd < 0 || ::ftruncate(fd, bytes) != 0) {
+                throw std::runtime_error("Не удалось создать общую память " + this->name);
+            }
+        } else {
+            // Сегмент готов, когда rank 0 задал ему размер
+            struct stat st;
+            while ((fd = ::shm_open(this->name.c_str(), O_RDWR, 0600)) < 0 ||
+                   ::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) != bytes) {
+                if (fd >= 0) {
+                    ::close(fd);
+                }
+                if (secondsSince(start) > DISTRIBUTED_TIMEOUT_SECONDS) {
+                    throw std::runtime_error("Не удалось подключиться к общей памяти " + this->name);
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+        }
+
+        void* p = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) {
+            throw std::runtime_error("Не удалось отобразить общую память " + this->name);
+        }
+        base = p;
+        length = bytes;
+        header = static_cast<Header*>(base);
+        pids = reinterpret_cast<pid_t*>(header + 1);
+        slots = reinterpret_cast<float*>(reinterpret_cast<char*>(pids) + pid_bytes);
+
+        if (rank == 0) {
+            new (header) Header();
+            header->ready.store(1);
+        } else {
+            while (header->ready.load() != 1) {
+                waitStep(start);
+            }
+        }
+        pids[rank] = ::getpid();
+        header->attached.fetch_add(1);
+        while (header->attached.load() < static_cast<uint32_t>(world)) {
+            waitStep(start);
+        }
+        if (rank == 0) {
+            ::shm_unlink(this->name.c_str());
+        }
+    }
+
+    ~ShmAllReduce() override {
+        // Процесс уходит из-за ошибки: остальные не должны ждать его до конца тайм-аута
+        if (std::uncaught_exceptions() > 0) {
+            header->aborted.store(1);
+        }
+        ::munmap(base, length);
+    }
+
+    void sum(float* data, size_t count) override {
+        if (count > capacity) {
+            throw std::runtime_error("Буфер all-reduce больше, чем выделено в общей памяти");
+        }
+        std::memcpy(slots + my_rank * capacity, data, count * sizeof(float));
+        barrier();
+
+        float* result = slots + world * capacity;
+        size_t begin = count * my_rank / world, end = count * (my_rank + 1) / world;
+        std::memcpy(result + begin, slots + begin, (end - begin) * sizeof(float));
+        for (int r = 1; r < world; ++r) {
+            const float* slot = slots + r * capacity;
+            #pragma omp simd
+            for (size_t i = begin; i < end; ++i) {
+                result[i] += slot[i];
+            }
+        }
+        barrier();
+
+        // Следующий sum пишет в результат только после своего первого барьера, то есть когда все дочитали
+        std::memcpy(data, result, count * sizeof(float));
+    }
+
+    // Барьер со сменой фазы: последний пришедший обнуляет счётчик и переключает sense
+    void barrier() override {
+        local_sense ^= 1;
+        if (header->arrived.fetch_add(1) + 1 == static_cast<uint32_t>(world)) {
+            header->arrived.store(0);
+            header->sense.store(local_sense);
+            return;
+        }
+        auto start = std::chrono::steady_clock::now();
+        while (header->sense.load() != local_sense) {
+            waitStep(start);
+        }
+    }
+
+private:
+    struct alignas(64) Header {
+        std::atomic<uint32_t> ready{0};
+        std::atomic<uint32_t> attached{0};
+        std::atomic<uint32_t> aborted{0};
+        alignas(64) std::atomic<uint32_t> arrived{0};
+        alignas(64) std::atomic<uint32_t> sense{0};
+    };
+    static_assert(std::atomic<uint32_t>::is_always_lock_free, "атомики в общей памяти должны быть без блокировок");
+
+    std::string name;
+    size_t capacity;
+    uint32_t local_sense;
+    void* base;
+    size_t length;
+    Header* header;
+    pid_t* pids;
+    float* slots;
+    std::chrono::steady_clock::time_point last_check;
+
+    // Шаг ожидания: уступить ядро (процессов может быть больше, чем ядер) и проверить, живы ли остальные.
+    // Упавший процесс (например, убитый сигналом) флаг aborted не выставит, поэтому раз в 0.1 с
+    // проверяется, существуют ли процессы из таблицы pids
+    void waitStep(std::chrono::steady_clock::time_point start) {
+        if (header->aborted.load()) {
+            throw std::runtime_error("Другой процесс обучения завершился с ошибкой");
+        }
+        if (secondsSince(last_check) > 0.1) {
+            last_check = std::chrono::steady_clock::now();
+            for (int r = 0; r < world; ++r) {
+                if (r != my_rank && pids[r] > 0 && !processAlive(pids[r])) {
+                    throw std::runtime_error("Процесс обучения rank " + std::to_string(r) + " завершился");
+                }
+            }
+        }
+        if (timeout_seconds > 0 && secondsSince(start) > timeout_seconds) {
+            throw std::runtime_error("Другие процессы обучения не отвечают");
+        }
+        sched_yield();
+    }
+
+    // Завершившийся потомок остаётся зомби, пока его не дождались, поэтому смотрим состояние в /proc
+    static bool processAlive(pid_t pid) {
+        if (::kill(pid, 0) != 0 && errno == ESRCH) {
+            return false;
+        }
+        char path[64], stat[256];
+        std::snprintf(path, sizeof(path), "/proc/%d/stat", static_cast<int>(pid));
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            return true;
+        }
+        ssize_t n = ::read(fd, stat, sizeof(stat) - 1);
+        ::close(fd);
+        if (n <= 0) {
+            return true;
+        }
+        stat[n] = 0;
+        // Формат: pid (имя) состояние ...
+        const char* paren = std::strrchr(stat, ')');
+        return !(paren && paren[1] == ' ' && paren[2] == 'Z');
+    }
+};
+
+
+// Через сокеты Unix: rank 0 принимает подключения остальных, в sum получает их данные по порядку rank,
+// складывает и рассылает результат. Один узел принимает всё, но для градиентов небольших сетей
+// и нескольких процессов это не узкое место
+class SocketAllReduce : public AllReduce {
+public:
+    SocketAllReduce(const std::string& path, int rank, int world, size_t capacity)
+        : AllReduce(rank, world), capacity(capacity), peers(world, -1) {
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path)) {
+            throw std::runtime_error("Слишком длинный путь сокета: " + path);
+        }
+        std::memcpy(addr.sun_path, path.c_str(), path.size());
+
+        if (rank == 0) {
+            incoming.resize(capacity);
+            int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            ::unlink(path.c_str());
+            if (listener < 0 || ::bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+                ::listen(listener, world) != 0) {
+                throw std::runtime_error("Не удалось открыть сокет " + path);
+            }
+            applyTimeout(listener, timeout_seconds);
+            for (int i = 1; i < world; ++i) {
+                int fd = ::accept(listener, nullptr, nullptr);
+                if (fd < 0) {
+                    ::close(listener);
+                    throw std::runtime_error("Не все процессы подключились к " + path);
+                }
+                applyTimeout(fd, timeout_seconds);
+                int32_t peer_rank;
+                receive(fd, &peer_rank, sizeof(peer_rank));
+                if (peer_rank <= 0 || peer_rank >= world || peers[peer_rank] >= 0) {
+                    throw std::runtime_error("Некорректный rank подключившегося процесса: " + std::to_string(peer_rank));
+                }
+                peers[peer_rank] = fd;
+            }
+            ::close(listener);
+            ::unlink(path.c_str());
+        } else {
+            auto start = std::chrono::steady_clock::now();
+            int fd;
+            while (true) {
+                fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+                if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0) {
+                    break;
+                }
+                ::close(fd);
+                if (secondsSince(start) > DISTRIBUTED_TIMEOUT_SECONDS) {
+                    throw std::runtime_error("Не удалось подключиться к " + path);
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            applyTimeout(fd, timeout_seconds);
+            int32_t my = rank;
+            send(fd, &my, sizeof(my));
+            peers[0] = fd;
+        }
+    }
+
+    ~SocketAllReduce() override {
+        for (int fd : peers) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+    }
+
+    void sum(float* data, size_t count) override {
+        if (count > capacity) {
+            throw std::runtime_error("Буфер all-reduce больше заданной ёмкости");
+        }
+        if (my_rank != 0) {
+            send(peers[0], data, count * sizeof(float));
+            receive(peers[0], data, count * sizeof(float));
+            return;
+        }
+        for (int r = 1; r < world; ++r) {
+            receive(peers[r], incoming.data(), count * sizeof(float));
+            #pragma omp simd
+            for (size_t i = 0; i < count; ++i) {
+                data[i] += incoming[i];
+            }
+        }
+        for (int r = 1; r < world; ++r) {
+            send(peers[r], data, count * sizeof(float));
+        }
+    }
+
+    void barrier() override {
+        float token = 0.0f;
+        sum(&token, 1);
+    }
+
+    void setTimeout(int seconds) override {
+        AllReduce::setTimeout(seconds);
+        for (int fd : peers) {
+            if (fd >= 0) {
+                applyTimeout(fd, seconds);
+            }
+        }
+    }
+
+private:
+    size_t capacity;
+    std::vector<int> peers;
+    std::vector<float> incoming;
+
+    // Нулевой тайм-аут сокета — ждать без ограничения
+    static void applyTimeout(int fd, int seconds) {
+        timeval tv = {seconds, 0};
+        ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
+
+    static void send(int fd, const void* data, size_t bytes) {
+        const char* p = static_cast<const char*>(data);
+        while (bytes > 0) {
+            ssize_t n = ::send(fd, p, bytes, MSG_NOSIGNAL);
+            if (n <= 0) {
+                throw std::runtime_error("Другой процесс обучения отключился");
+            }
+            p += n;
+            bytes -= n;
+        }
+    }
+
+    static void receive(int fd, void* data, size_t bytes) {
+        char* p = static_cast<char*>(data);
+        while (bytes > 0) {
+            ssize_t n = ::recv(fd, p, bytes, 0);
+            if (n <= 0) {
+                throw std::runtime_error("Другой процесс обучения отключился или не отвечает");
+            }
+            p += n;
+            bytes -= n;
+        }
+    }
+};
+
+
+// transport — shm или socket; rendezvous — общее для всех процессов имя: имя сегмента общей памяти
+// или сокета во временном каталоге
+std::unique_ptr<AllReduce> makeAllReduce(const std::string& transport, const std::string& rendezvous,
+                                         int rank, int world, size_t capacity) {
+    if (transport == "shm") {
+        return std::unique_ptr<AllReduce>(new ShmAllReduce(rendezvous, rank, world, capacity));
+    }
+    if (transport == "socket") {
+        std::string path = (std::filesystem::temp_directory_path() / (rendezvous + ".sock")).string();
+        return std::unique_ptr<AllReduce>(new SocketAllReduce(path, rank, world, capacity));
+    }
+    throw std::runtime_error("Неизвестный транспорт распределённого обучения: " + transport + " (нужен shm или socket)");
+}
+
+
+// Запускает world - 1 копий текущего процесса через fork и возвращает rank: 0 — исходный процесс,
+// у остальных 1 ... world - 1, их pid записываются в children. Вызывать до создания любых нитей.
+// Копии получают SIGTERM, если исходный процесс завершится раньше них
+int forkLocalRanks(int world, std::vector<pid_t>& children) {
+    pid_t parent = ::getpid();
+    // Иначе недописанный буфер вывода напечатали бы все копии
+    std::cout.flush();
+    std::fflush(nullptr);
+    for (int rank = 1; rank < world; ++rank) {
+        pid_t pid = ::fork();
+        if (pid < 0) {
+            throw std::runtime_error("Не удалось запустить процесс обучения rank " + std::to_string(rank));
+        }
+        if (pid == 0) {
+            ::prctl(PR_SET_PDEATHSIG, SIGTERM);
+            if (::getppid() != parent) {
+                std::_Exit(1);
+            }
+            children.clear();
+            return rank;
+        }
+        children.push_back(pid);
+    }
+    return 0;
+}
+
+
+// Дожидается процессов из forkLocalRanks; false, если какой-то завершился с ошибкой
+bool waitLocalRanks(const std::vector<pid_t>& children) {
+    bool ok = true;
+    for (pid_t pid : children) {
+        int status = 0;
+        if (::waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            ok = false;
+        }
+    }
+    return ok;
+}
@@ -0,0 +1,475 @@
+#pragma once
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <immintrin.h>
+#include <omp.h>
+#include "thread_pool.hpp"
+
+
+// SGEMM C = op(A) * op(B) для row-major матриц.
+// Схема как в BLIS/GotoBLAS: B упаковывается в панели по NR столбцов (блок KC x NC, живёт в L2/L3),
+// A упаковывается в панели по MR строк (блок MC x KC, живёт в L2), микроядро MR x NR держит
+// аккумуляторы в регистрах. Микроядро выбирается при первом вызове по возможностям процессора.
+namespace gemm {
+
+enum class Op { N, T };
+
+const size_t KC = 256;
+const size_t MC = 144;
+const size_t NC = 2048;
+// Ниже этого объёма работы (M * N * K) упаковка не окупается
+const size_t SMALL_WORK = 16384;
+// Не больше одной нити на столько умножений-сложений: у небольших произведений (батч 512 x 64 x 3)
+// регион OpenMP на все нити дороже самого счёта
+const size_t THREAD_WORK = 1 << 18;
+
+
+// Поэлементная обработка готового результата, пока тайл ещё в L1:
+// C = sin(scale * (C + bias[j])) при sine = true, иначе C = scale * (C + bias[j]).
+// Если cos_out не nullptr, туда (с тем же ldc, что и у C) пишется cos того же аргумента
+struct Epilogue {
+    const float* bias = nullptr;
+    float scale = 1.0f;
+    bool sine = false;
+    float* cos_out = nullptr;
+};
+
+
+// sin и cos одного аргумента без ветвлений и вызовов libm, чтобы цикл по строке тайла векторизовался:
+// редукция Коди-Уэйта к [-pi/4, pi/4] и минимаксные полиномы Cephes. Точность ~1e-7 при |x| < 1e5
+__attribute__((always_inline))
+inline void sinCos(float x, float& s, float& c) {
+    const float TWO_OVER_PI = 0.636619772367581f;
+    const float DP1 = 1.5703125f, DP2 = 4.837512969970703125e-4f, DP3 = 7.54978995489188216e-8f;
+    const float ROUND = 12582912.0f; // 1.5 * 2^23: сложение и вычитание округляют до целого
+
+    float j = (x * TWO_OVER_PI + ROUND) - ROUND;
+    int q = static_cast<int>(j) & 3;
+    float y = ((x - j * DP1) - j * DP2) - j * DP3;
+    float z = y * y;
+
+    float sy = y + y * z * (-1.6666654611e-1f + z * (8.3321608736e-3f + z * -1.9515295891e-4f));
+    float cy = 1.0f - 0.5f * z + z * z * (4.166664568298827e-2f + z * (-1.388731625493765e-3f + z * 2.443315711809948e-5f));
+
+    // Выбор по четверти арифметикой, а не ветвлением: иначе AVX2/SSE не векторизуют цикл.
+    // Один из множителей всегда 0, другой 1, поэтому результат точный
+    float odd = static_cast<float>(q & 1);
+    float sAbs = odd * cy + (1.0f - odd) * sy;
+    float cAbs = odd * sy + (1.0f - odd) * cy;
+    s = (1.0f - 2.0f * static_cast<float>((q >> 1) & 1)) * sAbs;
+    c = (1.0f - 2.0f * static_cast<float>(((q + 1) >> 1) & 1)) * cAbs;
+}
+
+// Одна строка тайла: cols элементов, j0 — номер первого столбца в C
+__attribute__((always_inline))
+inline void epilogueRowBody(const Epilogue& e, float* row, float* cos_row, size_t cols, size_t j0) {
+    const float scale = e.scale;
+    if (e.bias) {
+        const float* bias = e.bias + j0;
+        #pragma omp simd
+        for (size_t j = 0; j < cols; ++j) row[j] = scale * (row[j] + bias[j]);
+    } else {
+        #pragma omp simd
+        for (size_t j = 0; j < cols; ++j) row[j] = scale * row[j];
+    }
+    if (!e.sine) {
+        return;
+    }
+    if (cos_row) {
+        #pragma omp simd
+        for (size_t j = 0; j < cols; ++j) sinCos(row[j], row[j], cos_row[j]);
+    } else {
+        #pragma omp simd
+        for (size_t j = 0; j < cols; ++j) {
+            float c;
+            sinCos(row[j], row[j], c);
+        }
+    }
+}
+
+typedef void (*EpilogueRow)(const Epilogue& e, float* row, float* cos_row, size_t cols, size_t j0);
+
+inline void epilogueRowScalar(const Epilogue& e, float* row, float* cos_row, size_t cols, size_t j0) {
+    epilogueRowBody(e, row, cos_row, cols, j0);
+}
+
+__attribute__((target("avx2,fma")))
+inline void epilogueRowAvx2(const Epilogue& e, float* row, float* cos_row, size_t cols, size_t j0) {
+    epilogueRowBody(e, row, cos_row, cols, j0);
+}
+
+__attribute__((target("avx512f")))
+inline void epilogueRowAvx512(const Epilogue& e, float* row, float* cos_row, size_t cols, size_t j0) {
+    epilogueRowBody(e, row, cos_row, cols, j0);
+}
+
+
+typedef void (*MicroKernel)(size_t kc, const float* a, const float* b, float* c, size_t ldc, bool accumulate);
+
+struct Kernel {
+    const char* name;
+    size_t mr, nr;
+    MicroKernel fn;
+    EpilogueRow epilogue;
+};
+
+
+// Переносимое микроядро 4x8, компилятор векторизует его под базовый SSE
+inline void kernelScalar(size_t kc, const float* a, const float* b, float* c, size_t ldc, bool accumulate) {
+    const size_t MR = 4, NR = 8;
+    float acc[MR][NR] = {};
+    for (size_t k = 0; k < kc; ++k) {
+        for (size_t r = 0; r < MR; ++r) {
+            for (size_t j = 0; j < NR; ++j) {
+                acc[r][j] += a[r] * b[j];
+            }
+        }
+        a += MR;
+        b += NR;
+    }
+    for (size_t r = 0; r < MR; ++r) {
+        for (size_t j = 0; j < NR; ++j) {
+            c[r * ldc + j] = accumulate ? c[r * ldc + j] + acc[r][j] : acc[r][j];
+        }
+    }
+}
+
+
+// 6x16: 12 аккумуляторов ymm + 2 регистра под B + 1 под broadcast
+__attribute__((target("avx2,fma")))
+inline void kernelAvx2(size_t kc, const float* a, const float* b, float* c, size_t ldc, bool accumulate) {
+    const int MR = 6;
+    __m256 acc[MR][2];
+    #pragma GCC unroll 6
+    for (int r = 0; r < MR; ++r) {
+        acc[r][0] = _mm256_setzero_ps();
+        acc[r][1] = _mm256_setzero_ps();
+    }
+    for (size_t k = 0; k < kc; ++k) {
+        __m256 b0 = _mm256_loadu_ps(b);
+        __m256 b1 = _mm256_loadu_ps(b + 8);
+        #pragma GCC unroll 6
+        for (int r = 0; r < MR; ++r) {
+            __m256 ar = _mm256_broadcast_ss(a + r);
+            acc[r][0] = _mm256_fmadd_ps(ar, b0, acc[r][0]);
+            acc[r][1] = _mm256_fmadd_ps(ar, b1, acc[r][1]);
+        }
+        a += MR;
+        b += 16;
+    }
+    #pragma GCC unroll 6
+    for (int r = 0; r < MR; ++r) {
+        float* row = c + r * ldc;
+        if (accumulate) {
+            acc[r][0] = _mm256_add_ps(acc[r][0], _mm256_loadu_ps(row));
+            acc[r][1] = _mm256_add_ps(acc[r][1], _mm256_loadu_ps(row + 8));
+        }
+        _mm256_storeu_ps(row, acc[r][0]);
+        _mm256_storeu_ps(row + 8, acc[r][1]);
+    }
+}
+
+
+// 12x32: 24 аккумулятора zmm из 32
+__attribute__((target("avx512f")))
+inline void kernelAvx512(size_t kc, const float* a, const float* b, float* c, size_t ldc, bool accumulate) {
+    const int MR = 12;
+    __m512 acc[MR][2];
+    #pragma GCC unroll 12
+    for (int r = 0; r < MR; ++r) {
+        acc[r][0] = _mm512_setzero_ps();
+        acc[r][1] = _mm512_setzero_ps();
+    }
+    for (size_t k = 0; k < kc; ++k) {
+        __m512 b0 = _mm512_loadu_ps(b);
+        __m512 b1 = _mm512_loadu_ps(b + 16);
+        #pragma GCC unroll 12
+        for (int r = 0; r < MR; ++r) {
+            __m512 ar = _mm512_set1_ps(a[r]);
+            acc[r][0] = _mm512_fmadd_ps(ar, b0, acc[r][0]);
+            acc[r][1] = _mm512_fmadd_ps(ar, b1, acc[r][1]);
+        }
+        a += MR;
+        b += 32;
+    }
+    #pragma GCC unroll 12
+    for (int r = 0; r < MR; ++r) {
+        float* row = c + r * ldc;
+        if (accumulate) {
+            acc[r][0] = _mm512_add_ps(acc[r][0], _mm512_loadu_ps(row));
+            acc[r][1] = _mm512_add_ps(acc[r][1], _mm512_loadu_ps(row + 16));
+        }
+        _mm512_storeu_ps(row, acc[r][0]);
+        _mm512_storeu_ps(row + 16, acc[r][1]);
+    }
+}
+
+
+inline Kernel selectKernel() {
+    const Kernel scalar = {"scalar", 4, 8, kernelScalar, epilogueRowScalar};
+    const Kernel avx2 = {"avx2", 6, 16, kernelAvx2, epilogueRowAvx2};
+    const Kernel avx512 = {"avx512", 12, 32, kernelAvx512, epilogueRowAvx512};
+
+    __builtin_cpu_init();
+    bool hasAvx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    bool hasAvx512 = __builtin_cpu_supports("avx512f");
+
+    // SIREN_GEMM_KERNEL=scalar|avx2|avx512 позволяет принудительно выбрать ядро (для сверки результатов)
+    const char* forced = std::getenv("SIREN_GEMM_KERNEL");
+    if (forced) {
+        std::string name(forced);
+        if (name == "scalar") return scalar;
+        if (name == "avx2" && hasAvx2) return avx2;
+        if (name == "avx512" && hasAvx512) return avx512;
+    }
+    if (hasAvx512) return avx512;
+    if (hasAvx2) return avx2;
+    return scalar;
+}
+
+inline const Kernel& kernel() {
+    static const Kernel k = selectKernel();
+    return k;
+}
+
+
+// Буфер под упакованные панели, выровненный на кэш-линию
+class PackBuffer {
+public:
+    PackBuffer() : ptr(nullptr), capacity(0) {}
+    ~PackBuffer() { std::free(ptr); }
+    PackBuffer(const PackBuffer&) = delete;
+    PackBuffer& operator=(const PackBuffer&) = delete;
+
+    float* reserve(size_t size) {
+        if (size > capacity) {
+            std::free(ptr);
+            size_t bytes = (size * sizeof(float) + 63) / 64 * 64;
+            ptr = static_cast<float*>(std::aligned_alloc(64, bytes));
+            if (!ptr) {
+                capacity = 0;
+                throw std::bad_alloc();
+            }
+            capacity = bytes / sizeof(float);
+        }
+        return ptr;
+    }
+
+private:
+    float* ptr;
+    size_t capacity;
+};
+
+inline PackBuffer& bufferA() {
+    static thread_local PackBuffer buffer;
+    return buffer;
+}
+
+inline PackBuffer& bufferB() {
+    static thread_local PackBuffer buffer;
+    return buffer;
+}
+
+
+// Операнды в логическом виде: op(A) имеет размер M x K, op(B) — K x N
+inline float elemA(Op op, const float* A, size_t lda, size_t i, size_t k) {
+    return op == Op::N ? A[i * lda + k] : A[k * lda + i];
+}
+
+inline float elemB(Op op, const float* B, size_t ldb, size_t k, size_t j) {
+    return op == Op::N ? B[k * ldb + j] : B[j * ldb + k];
+}
+
+
+// Панель из mr строк op(A) начиная с (i0, k0), хвост дополняется нулями
+inline void packPanelA(Op op, const float* A, size_t lda, size_t i0, size_t rows, size_t k0, size_t kc,
+                       size_t mr, float* dst) {
+    if (op == Op::N) {
+        for (size_t r = 0; r < mr; ++r) {
+            if (r < rows) {
+                const float* src = A + (i0 + r) * lda + k0;
+                for (size_t k = 0; k < kc; ++k) dst[k * mr + r] = src[k];
+            } else {
+                for (size_t k = 0; k < kc; ++k) dst[k * mr + r] = 0.0f;
+            }
+        }
+    } else {
+        for (size_t k = 0; k < kc; ++k) {
+            const float* src = A + (k0 + k) * lda + i0;
+            size_t r = 0;
+            for (; r < rows; ++r) dst[k * mr + r] = src[r];
+            for (; r < mr; ++r) dst[k * mr + r] = 0.0f;
+        }
+    }
+}
+
+// Панель из nr столбцов op(B) начиная с (k0, j0), хвост дополняется нулями
+inline void packPanelB(Op op, const float* B, size_t ldb, size_t k0, size_t kc, size_t j0, size_t cols,
+                       size_t nr, float* dst) {
+    if (op == Op::N) {
+        for (size_t k = 0; k < kc; ++k) {
+            const float* src = B + (k0 + k) * ldb + j0;
+            size_t j = 0;
+            for (; j < cols; ++j) dst[k * nr + j] = src[j];
+            for (; j < nr; ++j) dst[k * nr + j] = 0.0f;
+        }
+    } else {
+        for (size_t j = 0; j < nr; ++j) {
+            if (j < cols) {
+                const float* src = B + (j0 + j) * ldb + k0;
+                for (size_t k = 0; k < kc; ++k) dst[k * nr + j] = src[k];
+            } else {
+                for (size_t k = 0; k < kc; ++k) dst[k * nr + j] = 0.0f;
+            }
+        }
+    }
+}
+
+
+// Тайл rows x cols, левый верхний угол которого — элемент (i0, j0) матрицы C
+inline void applyEpilogue(const Kernel& ker, const Epilogue& e, float* c, size_t ldc, size_t rows, size_t cols,
+                          size_t i0, size_t j0) {
+    for (size_t r = 0; r < rows; ++r) {
+        float* cos_row = e.cos_out ? e.cos_out + (i0 + r) * ldc + j0 : nullptr;
+        ker.epilogue(e, c + r * ldc, cos_row, cols, j0);
+    }
+}
+
+
+// Блок mc x nc результата по упакованным A и B, (i0, j0) — положение блока в C для эпилога
+inline void macroKernel(const Kernel& ker, size_t mc, size_t nc, size_t kc, const float* packA, const float* packB,
+                        float* C, size_t ldc, bool accumulate, const Epilogue* epilogue, size_t i0, size_t j0) {
+    const size_t mr = ker.mr, nr = ker.nr;
+    alignas(64) float tile[12 * 32];
+
+    for (size_t jr = 0; jr < nc; jr += nr) {
+        size_t cols = std::min(nr, nc - jr);
+        const float* b = packB + jr * kc;
+        for (size_t ir = 0; ir < mc; ir += mr) {
+            size_t rows = std::min(mr, mc - ir);
+            const float* a = packA + ir * kc;
+            float* c = C + ir * ldc + jr;
+
+            if (rows == mr && cols == nr) {
+                ker.fn(kc, a, b, c, ldc, accumulate);
+            } else {
+                // Неполный тайл считаем во временный буфер и копируем только нужную часть
+                ker.fn(kc, a, b, tile, nr, false);
+                for (size_t r = 0; r < rows; ++r) {
+                    for (size_t j = 0; j < cols; ++j) {
+                        c[r * ldc + j] = accumulate ? c[r * ldc + j] + tile[r * nr + j] : tile[r * nr + j];
+                    }
+                }
+            }
+            if (epilogue) {
+                applyEpilogue(ker, *epilogue, c, ldc, rows, cols, i0 + ir, j0 + jr);
+            }
+        }
+    }
+}
+
+
+// Прямой цикл для маленьких задач (например, один вектор на пиксель в render)
+inline void sgemmSmall(Op opA, Op opB, size_t M, size_t N, size_t K,
+                       const float* A, size_t lda, const float* B, size_t ldb, float* C, size_t ldc, bool accumulate,
+                       const Epilogue* epilogue) {
+    for (size_t i = 0; i < M; ++i) {
+        float* c = C + i * ldc;
+        if (opB == Op::N) {
+            if (!accumulate) {
+                for (size_t j = 0; j < N; ++j) c[j] = 0.0f;
+            }
+            for (size_t k = 0; k < K; ++k) {
+                float aik = elemA(opA, A, lda, i, k);
+                const float* b = B + k * ldb;
+                for (size_t j = 0; j < N; ++j) c[j] += aik * b[j];
+            }
+        } else {
+            for (size_t j = 0; j < N; ++j) {
+                const float* b = B + j * ldb;
+                float sum = 0.0f;
+                for (size_t k = 0; k < K; ++k) sum += elemA(opA, A, lda, i, k) * b[k];
+                c[j] = accumulate ? c[j] + sum : sum;
+            }
+        }
+        if (epilogue) {
+            applyEpilogue(kernel(), *epilogue, c, ldc, 1, N, i, 0);
+        }
+    }
+}
+
+
+// C (M x N, ldc) = op(A) * op(B), при accumulate = true: C += op(A) * op(B).
+// epilogue применяется к каждому тайлу сразу после последнего блока по K
+inline void sgemm(Op opA, Op opB, size_t M, size_t N, size_t K,
+                  const float* A, size_t lda, const float* B, size_t ldb, float* C, size_t ldc,
+                  bool accumulate = false, const Epilogue* epilogue = nullptr) {
+    if (M == 0 || N == 0) {
+        return;
+    }
+    if (K == 0) {
+        if (!accumulate) {
+            for (size_t i = 0; i < M; ++i) std::memset(C + i * ldc, 0, N * sizeof(float));
+        }
+        if (epilogue) {
+            applyEpilogue(kernel(), *epilogue, C, ldc, M, N, 0, 0);
+        }
+        return;
+    }
+
+    const Kernel& ker = kernel();
+    const size_t mr = ker.mr, nr = ker.nr;
+
+    if (M < mr || M * N * K < SMALL_WORK) {
+        sgemmSmall(opA, opB, M, N, K, A, lda, B, ldb, C, ldc, accumulate, epilogue);
+        return;
+    }
+
+    // Во вложенном регионе нити уже заняты внешним циклом. Число нитей не влияет на результат:
+    // порядок суммирования по K задаётся только блоками KC
+    int threads = inParallelRegion() ? 1 : static_cast<int>(std::min<size_t>(parallelWorkers(),
+                                                                             std::max<size_t>(1, M * N * K / THREAD_WORK)));
+    // При небольшом M уменьшаем блок, чтобы работы хватило на все нити
+    size_t mc = (M + threads - 1) / threads;
+    mc = std::min(MC, (mc + mr - 1) / mr * mr);
+    size_t mBlocks = (M + mc - 1) / mc;
+
+    for (size_t jc = 0; jc < N; jc += NC) {
+        size_t nc = std::min(NC, N - jc);
+        size_t nPanels = (nc + nr - 1) / nr;
+
+        for (size_t pc = 0; pc < K; pc += KC) {
+            size_t kc = std::min(KC, K - pc);
+            bool accumulateBlock = accumulate || pc > 0;
+            const Epilogue* blockEpilogue = pc + kc == K ? epilogue : nullptr;
+            float* packB = bufferB().reserve(nPanels * nr * kc);
+
+            parallelFor(nPanels, threads, [&](size_t begin, size_t end, int) {
+                for (size_t p = begin; p < end; ++p) {
+                    size_t j0 = jc + p * nr;
+                    packPanelB(opB, B, ldb, pc, kc, j0, std::min(nr, N - j0), nr, packB + p * nr * kc);
+                }
+            });
+
+            parallelFor(mBlocks, threads, [&](size_t begin, size_t end, int) {
+                for (size_t blk = begin; blk < end; ++blk) {
+                    size_t ic = blk * mc;
+                    size_t rows = std::min(mc, M - ic);
+                    float* packA = bufferA().reserve((rows + mr - 1) / mr * mr * kc);
+                    for (size_t ir = 0; ir < rows; ir += mr) {
+                        packPanelA(opA, A, lda, ic + ir, std::min(mr, rows - ir), pc, kc, mr, packA + ir * kc);
+                    }
+                    macroKernel(ker, rows, nc, kc, packA, packB, C + ic * ldc + jc, ldc, accumulateBlock,
+                                blockEpilogue, ic, jc);
+                }
+            }, 1);
+        }
+    }
+}
+
+}
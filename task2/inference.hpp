@@ -1,4 +1,6 @@
 #include "network.hpp"
+#include "mapped_file.hpp"
+#include <cstring>
 
 
 struct Data {
@@ -6,35 +8,52 @@ struct Data {
     Matrix y;
 };
 
+// Файл отображается в память, и каждая матрица копируется из него одним блоком.
+// Размер файла сверяется с N из заголовка, поэтому обрезанный файл не читается молча
 Data loadData(const std::string& filename) {
-    std::ifstream file(filename, std::ios::binary);
-    if (!file) {
-        throw std::runtime_error("Cannot open test data file.");
-    }
-
+    MappedFile file(filename);
     int N;
-    file.read(reinterpret_cast<char*>(&N), sizeof(N));
+    if (file.size() < sizeof(N)) {
+        throw std::runtime_error("Файл точек слишком короткий: " + filename);
+    }
+    std::memcpy(&N, file.data(), sizeof(N));
+    if (N < 0) {
+        throw std::runtime_error("Некорректное число точек в файле " + filename + ": " + std::to_string(N));
+    }
+    size_t expected = sizeof(N) + static_cast<size_t>(N) * 4 * sizeof(float);
+    if (file.size() != expected) {
+        throw std::runtime_error("Размер файла точек " + filename + " не совпадает с заголовком: N = " +
+                                 std::to_string(N) + ", ожидалось " + std::to_string(expected) +
+                                 " байт, в файле " + std::to_string(file.size()));
+    }
 
     Matrix x(N, 3);
     Matrix y(N, 1);
+    const char* points = file.data() + sizeof(N);
+    std::memcpy(x.data.data(), points, x.data.size() * sizeof(float));
+    std::memcpy(y.data.data(), points + x.data.size() * sizeof(float), y.data.size() * sizeof(float));
+    return {x, y};
+}
 
-    for (int i = 0; i < x.rows; ++i) {
-        for (int j = 0; j < x.cols; ++j) {
-            file.read(reinterpret_cast<char*>(&x(i, j)), sizeof(float));
-        }
+// В формате loadData: N, затем N точек xyz, затем N расстояний
+void saveData(const Data& data, const std::string& filename) {
+    std::ofstream file(filename, std::ios::binary);
+    if (!file) {
+        throw std::runtime_error("Не удалось открыть файл для записи: " + filename);
     }
 
-    for (int i = 0; i < y.rows; ++i) {
-        for (int j = 0; j < y.cols; ++j) {
-            file.read(reinterpret_cast<char*>(&y(i, j)), sizeof(float));
-        }
+    int N = data.x.rows;
+    file.write(reinterpret_cast<const char*>(&N), sizeof(N));
+    file.write(reinterpret_cast<const char*>(data.x.data.data()), data.x.data.size() * sizeof(float));
+    file.write(reinterpret_cast<const char*>(data.y.data.data()), data.y.data.size() * sizeof(float));
+    if (!file) {
+        throw std::runtime_error("Ошибка записи в файл: " + filename);
     }
-
-    return {x, y};
 }
 
-void test(SIREN& model, const Data& data) {
-    Matrix output = model.forward(data.x);
+void test(const SIREN& model, const Data& data) {
+    InferenceWorkspace ws;
+    Matrix output = model.forward(data.x, ws);
     float error = (output - data.y).abs().max();
 
     if (error < 1e-5) {
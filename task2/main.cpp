@@ -1,4 +1,45 @@
 #include "train.hpp"
+#include "alloc_counter.hpp"
+#include <map>
+
+
+// Необязательные параметры вида --key value могут идти в любом месте после режима
+struct Options {
+    std::vector<std::string> positional;
+    std::map<std::string, std::string> named;
+
+    Options(int argc, char* argv[]) {
+        for (int i = 2; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg.rfind("--", 0) == 0 && i + 1 < argc) {
+                named[arg.substr(2)] = argv[++i];
+            } else {
+                positional.push_back(arg);
+            }
+        }
+    }
+
+    bool has(const std::string& key) const {
+        return named.count(key) > 0;
+    }
+
+    std::string get(const std::string& key, const std::string& fallback = "") const {
+        auto it = named.find(key);
+        return it == named.end() ? fallback : it->second;
+    }
+};
+
+
+RenderMode parseRenderMode(const Options& options) {
+    std::string mode = options.get("render-mode", "wavefront");
+    if (mode == "pixel") {
+        return RenderMode::PerPixel;
+    }
+    if (mode != "wavefront") {
+        std::cerr << "Неизвестный режим рендера: " << mode << ", используется wavefront" << std::endl;
+    }
+    return RenderMode::Wavefront;
+}
 
 
 int main(int argc, char* argv[]) {
@@ -7,45 +48,136 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
+    heap_allocation_counter = &heap_allocations;
     std::string mode = argv[1];
+    Options options(argc, argv);
+    const std::vector<std::string>& args = options.positional;
 
     if (mode == "train") {
-        if (argc != 8) {
+        if (args.size() != 6) {
             std::cerr << "Для режима обучения требуется arch.txt, file.obj, train_params.txt, cam.txt, light.txt, num_threads" << std::endl;
             return 1;
         }
-        std::string archPath = argv[2];
-        std::string objPath = argv[3];
-        std::string trainPath = argv[4];
-        std::string camPath = argv[5];
-        std::string lightPath = argv[6];
-        int num_threads = std::stoi(argv[7]);
+        std::string archPath = args[0];
+        std::string objPath = args[1];
+        std::string trainPath = args[2];
+        std::string camPath = args[3];
+        std::string lightPath = args[4];
+        int num_threads = std::stoi(args[5]);
+
+        // Распределённое обучение: --ranks N запускает N процессов на этой машине (этот процесс — rank 0).
+        // Запущенные вручную процессы задают --rank, --world и общее для всех --rendezvous
+        std::vector<pid_t> children;
+        int rank = 0, world = 1;
+        std::string rendezvous = options.get("rendezvous");
+        if (options.has("ranks")) {
+            world = std::stoi(options.get("ranks"));
+            if (rendezvous.empty()) {
+                rendezvous = "siren-" + std::to_string(getpid());
+            }
+            rank = forkLocalRanks(world, children);
+        } else if (options.has("world")) {
+            world = std::stoi(options.get("world"));
+            rank = std::stoi(options.get("rank", "0"));
+            if (rendezvous.empty() || rank < 0 || rank >= world) {
+                std::cerr << "Для распределённого обучения нужны --rank от 0 до world - 1 и --rendezvous" << std::endl;
+                return 1;
+            }
+        }
+
         omp_set_num_threads(num_threads);
+        // Процессы одной машины закрепляют нити своих пулов за разными ядрами
+        if (world > 1) {
+            poolCpuRange() = {rank * num_threads, world * num_threads};
+        }
+        // При SIREN_PARALLEL_BACKEND=pool здесь создаётся пул на num_threads нитей — до фоновых нитей
+        parallelWorkers();
+
+        try {
+            TrainParams params(trainPath);
+            SIREN model(archPath);
+            int start_step = 0;
+            if (options.has("resume")) {
+                start_step = resumeTraining(model, params, options.get("resume"));
+            } else {
+                model.initParams(params.seed);
+            }
+
+            std::unique_ptr<AllReduce> comm;
+            if (world > 1) {
+                if (params.batch_size < world) {
+                    throw std::runtime_error("batch_size меньше числа процессов");
+                }
+                comm = makeAllReduce(options.get("transport", "shm"), rendezvous, rank, world,
+                                     std::max<size_t>(model.numParams(), params.grad_accum_steps));
+            }
 
-        SIREN model(archPath);
-        Mesh mesh(objPath);
-        Data data = sampleData(mesh, 50000);
-        TrainParams params(trainPath);
-        train(model, data, params, camPath, lightPath);
-        render(model, camPath, lightPath, "train_results/render.png", 512);
-        model.saveWeights("train_results/weights.bin");
+            if (options.has("points")) {
+                // Готовый файл точек: меш не нужен
+                Data data = loadData(options.get("points"));
+                train(model, data, params, camPath, lightPath, start_step, comm.get());
+            } else if (params.sample_workers > 0) {
+                Mesh mesh(objPath);
+                SampleGenerator generator(mesh, params.sampling, params.seed, params.batch_size,
+                                          params.sample_workers, params.sample_queue,
+                                          uint64_t(start_step) * params.grad_accum_steps,
+                                          rankRowsBegin(params, comm.get()), rankRowsEnd(params, comm.get()));
+                train(model, generator, params, camPath, lightPath, start_step, comm.get());
+            } else {
+                // Кэш точек пишет rank 0, остальные берут готовый файл. Выборка всего набора
+                // на большом меше может идти дольше DISTRIBUTED_TIMEOUT_SECONDS, поэтому это ожидание
+                // без тайм-аута: падение rank 0 всё равно заметят проверки транспорта
+                if (comm && rank != 0) {
+                    comm->setTimeout(0);
+                    comm->barrier();
+                    comm->setTimeout(DISTRIBUTED_TIMEOUT_SECONDS);
+                }
+                Data data = cachedSampleData(objPath, params.sample_cache, params.num_samples, params.seed, params.sampling);
+                if (comm && rank == 0) {
+                    comm->barrier();
+                }
+                train(model, data, params, camPath, lightPath, start_step, comm.get());
+            }
+            if (rank == 0) {
+                render(model, camPath, lightPath, "train_results/render.png", 512, parseRenderMode(options));
+                model.saveWeights("train_results/weights.bin");
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Ошибка обучения (rank " << rank << "): " << e.what() << std::endl;
+            return 1;
+        }
+        if (!waitLocalRanks(children)) {
+            std::cerr << "Один из процессов обучения завершился с ошибкой" << std::endl;
+            return 1;
+        }
     } else if (mode == "render") {
-        if (argc != 7) {
+        if (args.size() != 5) {
             std::cerr << "Для режима рендера требуются arch.txt, weights.bin, cam.txt, light.txt, num_threads" << std::endl;
             return 1;
         }
-        std::string archPath = argv[2];
-        std::string weightsPath = argv[3];
-        std::string camPath = argv[4];
-        std::string lightPath = argv[5];
-        int num_threads = std::stoi(argv[6]);
+        std::string archPath = args[0];
+        std::string weightsPath = args[1];
+        std::string camPath = args[2];
+        std::string lightPath = args[3];
+        int num_threads = std::stoi(args[4]);
         omp_set_num_threads(num_threads);
+        // При SIREN_PARALLEL_BACKEND=pool здесь создаётся пул на num_threads нитей — до фоновых нитей
+        parallelWorkers();
 
-        SIREN model(archPath);
+        // Вместо arch.txt можно передать "-": архитектура возьмётся из файла весов v2
+        SIREN model(archPath == "-" ? weightsPath : archPath);
         model.loadWeights(weightsPath);
-        render(model, camPath, lightPath, "render_results/out_cpu.png", 512);
+        render(model, camPath, lightPath, "render_results/out_cpu.png", 512, parseRenderMode(options));
+    } else if (mode == "bench") {
+        if (args.size() < 1 || args.size() > 2) {
+            std::cerr << "Для режима замера требуются file.obj и необязательное число точек" << std::endl;
+            return 1;
+        }
+        Mesh mesh(args[0]);
+        int num_points = args.size() > 1 ? std::stoi(args[1]) : 10000;
+        benchMesh(mesh, num_points);
     } else {
-        std::cerr << "Неизвестный режим. Используйте 'train' для обучения или 'render' для рендера." << std::endl;
+        std::cerr << "Неизвестный режим. Используйте 'train' для обучения, 'render' для рендера или 'bench' для замера." << std::endl;
         return 1;
     }
 
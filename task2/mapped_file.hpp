@@ -0,0 +1,57 @@
+#pragma once
+#include <string>
+#include <stdexcept>
+#include <cstddef>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+// Файл, отображённый в память. Страницы подгружаются ядром по мере обращения и общие для всех
+// процессов, которые отображают тот же файл. При writable = true отображение частное (copy-on-write):
+// запись в память меняет только копию страницы у этого процесса, сам файл не меняется
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& filename, bool writable = false) : ptr(nullptr), length(0) {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Не удалось открыть файл: " + filename);
+        }
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw std::runtime_error("Не удалось узнать размер файла: " + filename);
+        }
+        length = static_cast<size_t>(st.st_size);
+        // Пустой файл отобразить нельзя, он просто остаётся без данных
+        if (length > 0) {
+            void* p = writable ? ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)
+                               : ::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+            if (p == MAP_FAILED) {
+                ::close(fd);
+                throw std::runtime_error("Не удалось отобразить файл в память: " + filename);
+            }
+            ptr = static_cast<char*>(p);
+        }
+        ::close(fd);
+    }
+
+    ~MappedFile() {
+        if (ptr) {
+            ::munmap(ptr, length);
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // Писать можно только в отображение с writable = true
+    char* data() { return ptr; }
+    const char* data() const { return ptr; }
+    size_t size() const { return length; }
+
+private:
+    char* ptr;
+    size_t length;
+};
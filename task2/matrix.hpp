@@ -1,8 +1,171 @@
+#pragma once
 #include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <new>
 #include <iostream>
 #include <cassert>
+#include <string>
 #include <glm/glm.hpp>
 #include <omp.h>
+#include "gemm.hpp"
+
+
+// Владеющий буфер float, выровненный на 64 байта (кэш-линия и ширина регистра AVX-512)
+class AlignedBuffer {
+public:
+    AlignedBuffer() : ptr(nullptr), count(0) {}
+    explicit AlignedBuffer(size_t size) : AlignedBuffer() { resize(size); }
+    ~AlignedBuffer() { std::free(ptr); }
+
+    AlignedBuffer(const AlignedBuffer& other) : AlignedBuffer(other.count) {
+        std::copy(other.ptr, other.ptr + count, ptr);
+    }
+
+    AlignedBuffer& operator=(const AlignedBuffer& other) {
+        if (this != &other) {
+            resize(other.count);
+            std::copy(other.ptr, other.ptr + count, ptr);
+        }
+        return *this;
+    }
+
+    AlignedBuffer(AlignedBuffer&& other) noexcept : ptr(other.ptr), count(other.count) {
+        other.ptr = nullptr;
+        other.count = 0;
+    }
+
+    AlignedBuffer& operator=(AlignedBuffer&& other) noexcept {
+        std::swap(ptr, other.ptr);
+        std::swap(count, other.count);
+        return *this;
+    }
+
+    // Выделяет size нулевых элементов, прежнее содержимое не сохраняется
+    void resize(size_t size) {
+        std::free(ptr);
+        ptr = nullptr;
+        count = size;
+        if (size > 0) {
+            size_t bytes = (size * sizeof(float) + 63) / 64 * 64;
+            ptr = static_cast<float*>(std::aligned_alloc(64, bytes));
+            if (!ptr) {
+                count = 0;
+                throw std::bad_alloc();
+            }
+        }
+        zero();
+    }
+
+    void zero() {
+        std::fill(ptr, ptr + count, 0.0f);
+    }
+
+    float* data() { return ptr; }
+    const float* data() const { return ptr; }
+    size_t size() const { return count; }
+
+    float& operator[](size_t i) { return ptr[i]; }
+    const float& operator[](size_t i) const { return ptr[i]; }
+
+private:
+    float* ptr;
+    size_t count;
+};
+
+
+// Когда поэлементный цикл выполнять параллельно. Открыть и закрыть регион OpenMP стоит микросекунды,
+// поэтому цикл меньше grain элементов дешевле пройти в одной нити. Внутри уже параллельного региона
+// (например, по пикселям в render) вложенный регион при nested = false не открывается: нити и так заняты.
+// grain подбирается по цене элемента: у сложения он больше, чем у sin
+struct ParallelPolicy {
+    size_t grain;
+    bool nested;
+
+    bool parallel(size_t work) const;
+};
+
+
+// Пороги для типичных циклов; места вызова выбирают подходящий или задают свой
+const ParallelPolicy ELEMENTWISE_POLICY = {32768, false};
+const ParallelPolicy TRANSCENDENTAL_POLICY = {2048, false};
+
+
+// Общие для всех мест вызова настройки. grain_scale умножает пороги всех политик: 0 — параллельно
+// при любом размере, очень большой — всё последовательно. По умолчанию берётся из переменной
+// окружения SIREN_PARALLEL_GRAIN_SCALE. Менять до запуска параллельной работы
+struct ParallelSettings {
+    float grain_scale;
+};
+
+inline ParallelSettings& parallelSettings() {
+    static ParallelSettings settings = [] {
+        ParallelSettings s = {1.0f};
+        const char* scale = std::getenv("SIREN_PARALLEL_GRAIN_SCALE");
+        if (scale) {
+            try {
+                s.grain_scale = std::max(0.0f, std::stof(scale));
+            } catch (const std::exception&) {
+                std::cerr << "Некорректное значение SIREN_PARALLEL_GRAIN_SCALE: " << scale << std::endl;
+            }
+        }
+        return s;
+    }();
+    return settings;
+}
+
+inline bool ParallelPolicy::parallel(size_t work) const {
+    return work >= grain * parallelSettings().grain_scale && (nested || !inParallelRegion()) &&
+           parallelWorkers() > 1;
+}
+
+
+// parallelFor (thread_pool.hpp) на всех нитях, если policy разрешает распараллелить n элементов, иначе в этой нити
+template <class F>
+void parallelFor(size_t n, const ParallelPolicy& policy, F body, size_t chunk = 0) {
+    parallelFor(n, policy.parallel(n) ? parallelWorkers() : 1, body, chunk);
+}
+
+
+// Политика операторов Matrix в текущей нити: ELEMENTWISE_POLICY, пока её не заменил ScopedParallelPolicy
+inline const ParallelPolicy*& currentMatrixPolicy() {
+    thread_local const ParallelPolicy* policy = &ELEMENTWISE_POLICY;
+    return policy;
+}
+
+// Заменяет политику операторов Matrix в этой нити до конца области видимости
+class ScopedParallelPolicy {
+public:
+    explicit ScopedParallelPolicy(const ParallelPolicy& policy) : saved(currentMatrixPolicy()), policy(policy) {
+        currentMatrixPolicy() = &this->policy;
+    }
+    ~ScopedParallelPolicy() { currentMatrixPolicy() = saved; }
+
+    ScopedParallelPolicy(const ScopedParallelPolicy&) = delete;
+    ScopedParallelPolicy& operator=(const ScopedParallelPolicy&) = delete;
+
+private:
+    const ParallelPolicy* saved;
+    ParallelPolicy policy;
+};
+
+
+// Невладеющее представление row-major матрицы поверх чужой памяти (например, общего буфера параметров)
+struct MatrixView {
+    float* data;
+    size_t rows, cols;
+
+    MatrixView() : data(nullptr), rows(0), cols(0) {}
+    MatrixView(float* data, size_t rows, size_t cols) : data(data), rows(rows), cols(cols) {}
+
+    float& operator()(size_t row, size_t col) const {
+        return data[row * cols + col];
+    }
+
+    size_t size() const {
+        return rows * cols;
+    }
+};
 
 
 class Matrix {
@@ -10,11 +173,8 @@ public:
     std::vector<float> data;
     size_t rows, cols;
 
-    Matrix(size_t rows, size_t cols) : rows(rows), cols(cols), data(rows * cols) {
-        for (int i = 0; i < data.size(); ++i) { 
-            data[i] = 0;
-        }
-    }
+    // std::vector уже заполняет новые элементы нулями
+    Matrix(size_t rows, size_t cols) : rows(rows), cols(cols), data(rows * cols) {}
 
     Matrix() : rows(0), cols(0) {}
 
@@ -28,15 +188,20 @@ public:
         return data[row * cols + col];
     }
 
+    // Поэлементный проход body(begin, end, worker) по n элементам с политикой текущей нити (см. ScopedParallelPolicy)
+    template <class F>
+    static void forEach(size_t n, F body) {
+        parallelFor(n, *currentMatrixPolicy(), body);
+    }
+
     static Matrix transpose(const Matrix& m) {
         Matrix t(m.cols, m.rows);
 
-        #pragma omp parallel for
-        for (size_t i = 0; i < m.rows; ++i) {
-            for (size_t j = 0; j < m.cols; ++j) {
-                t(j, i) = m(i, j);
+        forEach(m.data.size(), [&](size_t begin, size_t end, int) {
+            for (size_t k = begin; k < end; ++k) {
+                t(k % m.cols, k / m.cols) = m.data[k];
             }
-        }
+        });
         return t;
     }
 
@@ -44,104 +209,109 @@ public:
         assert(a.cols == b.rows);
         Matrix result(a.rows, b.cols);
 
-        #pragma omp parallel for
-        for (size_t i = 0; i < result.rows; ++i) {
-            for (size_t j = 0; j < result.cols; ++j) {
-                float sum = 0.0;
-                for (size_t k = 0; k < a.cols; ++k) {
-                    sum += a(i, k) * b(k, j);
-                }
-                result(i, j) = sum;
-            }
-        }
+        gemm::sgemm(gemm::Op::N, gemm::Op::N, a.rows, b.cols, a.cols,
+                    a.data.data(), a.cols, b.data.data(), b.cols, result.data.data(), result.cols);
+        return result;
+    }
+
+    // a * b^T без явного транспонирования b
+    static Matrix multiplyNT(const Matrix& a, const Matrix& b) {
+        assert(a.cols == b.cols);
+        Matrix result(a.rows, b.rows);
+
+        gemm::sgemm(gemm::Op::N, gemm::Op::T, a.rows, b.rows, a.cols,
+                    a.data.data(), a.cols, b.data.data(), b.cols, result.data.data(), result.cols);
+        return result;
+    }
+
+    // a^T * b без явного транспонирования a
+    static Matrix multiplyTN(const Matrix& a, const Matrix& b) {
+        assert(a.rows == b.rows);
+        Matrix result(a.cols, b.cols);
+
+        gemm::sgemm(gemm::Op::T, gemm::Op::N, a.cols, b.cols, a.rows,
+                    a.data.data(), a.cols, b.data.data(), b.cols, result.data.data(), result.cols);
         return result;
     }
 
     Matrix operator+(const Matrix& rhs) const {
         assert(rows == rhs.rows && cols == rhs.cols); // Убедитесь, что размеры матриц совпадают
         Matrix result(rows, cols);
-        
-        #pragma omp parallel for
-        for (size_t i = 0; i < rows; ++i) {
-            for (size_t j = 0; j < cols; ++j) {
-                result(i, j) = (*this)(i, j) + rhs(i, j);
+
+        forEach(data.size(), [&](size_t begin, size_t end, int) {
+            for (size_t i = begin; i < end; ++i) {
+                result.data[i] = data[i] + rhs.data[i];
             }
-        }
+        });
         return result;
     }
 
     Matrix operator-(const Matrix& rhs) const {
         assert(rows == rhs.rows && cols == rhs.cols);
         Matrix result(rows, cols);
-        
-        #pragma omp parallel for
-        for (size_t i = 0; i < rows; ++i) {
-            for (size_t j = 0; j < cols; ++j) {
-                result(i, j) = (*this)(i, j) - rhs(i, j);
+
+        forEach(data.size(), [&](size_t begin, size_t end, int) {
+            for (size_t i = begin; i < end; ++i) {
+                result.data[i] = data[i] - rhs.data[i];
             }
-        }
+        });
         return result;
     }
 
     Matrix operator*(const Matrix& rhs) const {
         assert(rows == rhs.rows && cols == rhs.cols);
         Matrix result(rows, cols);
-        
-        #pragma omp parallel for
-        for (size_t i = 0; i < rows; ++i) {
-            for (size_t j = 0; j < cols; ++j) {
-                result(i, j) = (*this)(i, j) * rhs(i, j);
+
+        forEach(data.size(), [&](size_t begin, size_t end, int) {
+            for (size_t i = begin; i < end; ++i) {
+                result.data[i] = data[i] * rhs.data[i];
             }
-        }
+        });
         return result;
     }
 
     Matrix operator/(const Matrix& rhs) const {
         assert(rows == rhs.rows && cols == rhs.cols);
         Matrix result(rows, cols);
-        
-        #pragma omp parallel for
-        for (size_t i = 0; i < rows; ++i) {
-            for (size_t j = 0; j < cols; ++j) {
-                result(i, j) = (*this)(i, j) / rhs(i, j);
+
+        forEach(data.size(), [&](size_t begin, size_t end, int) {
+            for (size_t i = begin; i < end; ++i) {
+                result.data[i] = data[i] / rhs.data[i];
             }
-        }
+        });
         return result;
     }
 
     Matrix operator/(const float& val) const {
         Matrix result(rows, cols);
-        
-        #pragma omp parallel for
-        for (size_t i = 0; i < rows; ++i) {
-            for (size_t j = 0; j < cols; ++j) {
-                result(i, j) = (*this)(i, j) / val;
+
+        forEach(data.size(), [&](size_t begin, size_t end, int) {
+            for (size_t i = begin; i < end; ++i) {
+                result.data[i] = data[i] / val;
             }
-        }
+        });
         return result;
     }
 
     Matrix operator*(const float& val) const {
         Matrix result(rows, cols);
-        
-        #pragma omp parallel for
-        for (size_t i = 0; i < rows; ++i) {
-            for (size_t j = 0; j < cols; ++j) {
-                result(i, j) = (*this)(i, j) * val;
+
+        forEach(data.size(), [&](size_t begin, size_t end, int) {
+            for (size_t i = begin; i < end; ++i) {
+                result.data[i] = data[i] * val;
             }
-        }
+        });
         return result;
     }
 
     Matrix operator+(const float& val) const {
         Matrix result(rows, cols);
-        
-        #pragma omp parallel for
-        for (size_t i = 0; i < rows; ++i) {
-            for (size_t j = 0; j < cols; ++j) {
-                result(i, j) = (*this)(i, j) + val;
+
+        forEach(data.size(), [&](size_t begin, size_t end, int) {
+            for (size_t i = begin; i < end; ++i) {
+                result.data[i] = data[i] + val;
             }
-        }
+        });
         return result;
     }
 
@@ -156,20 +326,22 @@ public:
     Matrix abs() const {
         Matrix result(rows, cols);
 
-        #pragma omp parallel for
-        for (size_t i = 0; i < rows * cols; ++i) {
-            result.data[i] = std::abs(data[i]);
-        }
+        forEach(data.size(), [&](size_t begin, size_t end, int) {
+            for (size_t i = begin; i < end; ++i) {
+                result.data[i] = std::abs(data[i]);
+            }
+        });
         return result;
     }
 
     Matrix sqrt() const {
         Matrix result(rows, cols);
 
-        #pragma omp parallel for
-        for (size_t i = 0; i < rows * cols; ++i) {
-            result.data[i] = std::sqrt(data[i]);
-        }
+        forEach(data.size(), [&](size_t begin, size_t end, int) {
+            for (size_t i = begin; i < end; ++i) {
+                result.data[i] = std::sqrt(data[i]);
+            }
+        });
         return result;
     }
 
@@ -1,8 +1,13 @@
+#pragma once
 #include "inference.hpp"
+#include "bvh.hpp"
+#include "winding.hpp"
+#include "triangles.hpp"
 
 #include <glm/glm.hpp>
 #include <algorithm>
 #include <cmath>
+#include <chrono>
 
 
 float dot2( glm::vec3 v ) { return glm::dot(v,v); }
@@ -15,13 +20,18 @@ public:
     Triangle(const glm::vec3& v1, const glm::vec3& v2, const glm::vec3& v3) : v1(v1), v2(v2), v3(v3) {}
 
     float distance(const glm::vec3& p) const {
+        return sqrt(distance2(p));
+    }
+
+    // Квадрат расстояния: для сравнения кандидатов корень не нужен
+    float distance2(const glm::vec3& p) const {
         glm::vec3 v21 = v2 - v1; glm::vec3 p1 = p - v1;
         glm::vec3 v32 = v3 - v2; glm::vec3 p2 = p - v2;
         glm::vec3 v13 = v1 - v3; glm::vec3 p3 = p - v3;
         glm::vec3 nor = cross( v21, v13 );
 
 
-        return sqrt( // inside/outside test    
+        return ( // inside/outside test    
                  (glm::sign(glm::dot(glm::cross(v21,nor),p1)) + 
                   glm::sign(glm::dot(glm::cross(v32,nor),p2)) + 
                   glm::sign(glm::dot(glm::cross(v13,nor),p3))<2.0) 
@@ -36,24 +46,23 @@ public:
                   dot(nor,p1)*dot(nor,p1)/dot2(nor) );
     }
 
-    bool is_inside(const glm::vec3& p) const {
-        glm::vec3 nor = glm::normalize(glm::cross(v2 - v1, v3 - v1));
-        glm::vec3 p_proj = p - glm::dot(p - v1, nor) * nor;
-        float dotProduct = glm::dot(nor, p_proj - p);
-
-        if (dotProduct > 0) {
-            return false; // Точка лежит в плоскости по направлению нормали от треугольника
-        } else {
-            return true; // Точка лежит в противоположном направлении
-        }
-    }
-
 };
 
 
 class Mesh {
 public:
+    // Переупорядочены в порядке листьев bvh
     std::vector<Triangle> triangles;
+    BVH bvh;
+    WindingNumber winding;
+    TriangleBlocks blocks;
+    // Номер каждого треугольника в порядке добавления (как в .obj): input_order[k] — для triangles[k],
+    // surface_slot — обратная перестановка
+    std::vector<uint32_t> input_order;
+    std::vector<uint32_t> surface_slot;
+    // Накопленные площади треугольников в порядке добавления, а не BVH: порядок листьев зависит
+    // от ширины ядра, и точки на поверхности менялись бы от процессора к процессору
+    std::vector<double> area_cdf;
 
     Mesh(const std::string& filename) {
         std::ifstream file(filename);
@@ -89,31 +98,142 @@ public:
                 Triangle(vertices[vertex_idx.x - 1], vertices[vertex_idx.y - 1], vertices[vertex_idx.z - 1])
             );
         }
+        buildBVH();
     }
 
     Mesh() {}
 
     Mesh(const Triangle& triangle) {
         triangles.push_back(triangle);
+        buildBVH();
     }
 
+    // Дерево перестраивается целиком. Для большого меша лучше заполнить triangles и один раз вызвать buildBVH()
     void addTriangle(const Triangle& triangle) {
         triangles.push_back(triangle);
+        buildBVH();
+    }
+
+    void buildBVH() {
+        // addTriangle дописывает в конец, поэтому новые треугольники получают следующие номера
+        for (size_t i = input_order.size(); i < triangles.size(); ++i) {
+            input_order.push_back(static_cast<uint32_t>(i));
+        }
+
+        std::vector<glm::vec3> lo, hi;
+        lo.reserve(triangles.size());
+        hi.reserve(triangles.size());
+        for (const auto& t : triangles) {
+            lo.push_back(glm::min(glm::min(t.v1, t.v2), t.v3));
+            hi.push_back(glm::max(glm::max(t.v1, t.v2), t.v3));
+        }
+        bvh.build(lo, hi, triangleKernel().lanes);
+
+        std::vector<Triangle> sorted;
+        std::vector<uint32_t> sortedOrder;
+        sorted.reserve(triangles.size());
+        sortedOrder.reserve(triangles.size());
+        for (uint32_t i : bvh.order) {
+            sorted.push_back(triangles[i]);
+            sortedOrder.push_back(input_order[i]);
+        }
+        triangles.swap(sorted);
+        input_order.swap(sortedOrder);
+        winding.build(bvh, triangles);
+        blocks.build(bvh, triangles);
+
+        surface_slot.resize(triangles.size());
+        for (size_t k = 0; k < triangles.size(); ++k) {
+            surface_slot[input_order[k]] = static_cast<uint32_t>(k);
+        }
+        area_cdf.resize(triangles.size());
+        double total = 0.0;
+        for (size_t i = 0; i < triangles.size(); ++i) {
+            const Triangle& t = triangles[surface_slot[i]];
+            total += 0.5 * glm::length(glm::cross(t.v2 - t.v1, t.v3 - t.v1));
+            area_cdf[i] = total;
+        }
+    }
+
+    // Равномерная по площади точка поверхности: треугольник по накопленным площадям,
+    // точка в нём — по барицентрическим координатам (1 - sqrt(u1), sqrt(u1) (1 - u2), sqrt(u1) u2)
+    glm::vec3 sampleSurface(RandomStream& rng) const {
+        double target = rng.uniform() * area_cdf.back();
+        size_t index = std::upper_bound(area_cdf.begin(), area_cdf.end(), target) - area_cdf.begin();
+        const Triangle& t = triangles[surface_slot[std::min(index, triangles.size() - 1)]];
+
+        float r = std::sqrt(rng.uniform()), u = rng.uniform();
+        return t.v1 * (1.0f - r) + t.v2 * (r * (1.0f - u)) + t.v3 * (r * u);
     }
 
     float distance(const glm::vec3& point) const {
-        float minDistance = std::numeric_limits<float>::max();
-        bool isInside = true;
-        for (const auto& triangle : triangles) {
-            float dist = triangle.distance(point);
-            if (dist < minDistance) {
-                minDistance = dist;
-                isInside = triangle.is_inside(point);
-            }
+        const float NONE = std::numeric_limits<float>::max();
+        float best2 = NONE;
+        bvh.nearest(point, best2, [&](uint32_t node, float& best2) {
+            best2 = std::min(best2, blocks.leafDistance2(node, point));
+        });
+        if (best2 == NONE) {
+            return std::numeric_limits<float>::max();
         }
-        if (!isInside) {
+
+        // Знак по числу обмотки, а не по ближайшему треугольнику: у рёбер и вершин ближайших
+        // треугольников несколько, и их нормали могут указывать в разные стороны.
+        // Модуль — чтобы знак не зависел от ориентации граней меша
+        float minDistance = std::sqrt(best2);
+        float w = winding.evaluate(bvh, point, [&](uint32_t node) {
+            return blocks.leafSolidAngle(node, point);
+        });
+        if (std::fabs(w) > 0.5f) {
             return -minDistance;
         }
         return minDistance;
     }
-};
\ No newline at end of file
+};
+
+
+// Замер ядра расстояний на num_points случайных точках куба [-1, 1]^3: полный перебор
+// по Triangle::distance2, полный перебор блоками SoA и запрос Mesh::distance (BVH + знак)
+void benchMesh(const Mesh& mesh, int num_points) {
+    RandomStream rng(0, randomStream(RandomPurpose::Debug, 1));
+    std::vector<glm::vec3> points(num_points);
+    for (auto& p : points) {
+        p.x = rng.uniform(-1.0f, 1.0f);
+        p.y = rng.uniform(-1.0f, 1.0f);
+        p.z = rng.uniform(-1.0f, 1.0f);
+    }
+    std::vector<float> reference(num_points), blocked(num_points);
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < num_points; ++i) {
+        float best2 = std::numeric_limits<float>::max();
+        for (const auto& triangle : mesh.triangles) {
+            best2 = std::min(best2, triangle.distance2(points[i]));
+        }
+        reference[i] = best2;
+    }
+    auto middle = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < num_points; ++i) {
+        blocked[i] = mesh.blocks.distance2(points[i]);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    float checksum = 0.0f;
+    for (int i = 0; i < num_points; ++i) {
+        checksum += mesh.distance(points[i]);
+    }
+    auto last = std::chrono::high_resolution_clock::now();
+
+    float maxError = 0.0f;
+    for (int i = 0; i < num_points; ++i) {
+        maxError = std::max(maxError, std::fabs(std::sqrt(reference[i]) - std::sqrt(blocked[i])));
+    }
+    double pairs = double(num_points) * mesh.triangles.size();
+    std::chrono::duration<double, std::nano> loop = middle - start, simd = end - middle;
+    std::chrono::duration<double, std::micro> query = last - end;
+
+    std::cout << "Triangles: " << mesh.triangles.size() << ", BVH nodes: " << mesh.bvh.nodes.size()
+              << ", kernel: " << triangleKernel().name << " (" << mesh.blocks.lanes << " lanes)" << std::endl;
+    std::cout << "Triangle loop: " << loop.count() / pairs << " ns per point-triangle" << std::endl;
+    std::cout << "SoA kernel: " << simd.count() / pairs << " ns per point-triangle, speedup "
+              << loop.count() / simd.count() << "x, max difference " << maxError << std::endl;
+    std::cout << "Mesh::distance: " << query.count() / num_points << " us per point (checksum " << checksum << ")" << std::endl;
+}
@@ -1,47 +1,84 @@
+#pragma once
 #include "matrix.hpp"
+#include "optimizer.hpp"
+#include "random.hpp"
+#include "weights_file.hpp"
 #include <cmath>
 #include <fstream>
 #include <sstream>
 #include <string>
 #include <limits>
 #include <random>
+#include <memory>
+#include <stdexcept>
+#include <cstring>
+#include <cctype>
+#include <iterator>
 
 
 class Layer {
 public:
     virtual ~Layer() {}
-    virtual void loadWeights(std::ifstream& file) = 0;
     virtual Matrix forward(const Matrix& input) = 0;
+    // Возвращает градиент по входу и прибавляет градиенты своих параметров к буферу градиентов.
+    // Веса не меняются: шаг оптимизатора выполняется отдельно (SIREN::step)
     virtual Matrix backward(const Matrix& grad) = 0;
-    virtual void saveWeights(std::ofstream& file) = 0;
     virtual void printWeights() const = 0; // Добавленный метод
-    virtual void setLR(const float& lr) = 0;
+
+    // Инференс без кэшей обучения: input (rows x width) -> output (rows x outputWidth(width)).
+    // Метод const, поэтому его можно вызывать из нескольких нитей, если у каждой свои буферы.
+    // Если cache не nullptr, слой сохраняет туда rows x cacheWidth(width) чисел для inferGrad
+    virtual void infer(const float* input, float* output, float* cache, size_t rows, size_t width) const = 0;
+    virtual size_t outputWidth(size_t input_width) const { return input_width; }
+    virtual size_t cacheWidth(size_t input_width) const { return 0; }
+    // Обратный проход по входу для инференса: grad_input = grad_output * d(output)/d(input),
+    // input и cache — те же, что были у infer. grad_output слой может использовать как рабочую
+    // память и испортить. Градиенты параметров не трогает
+    virtual void inferGrad(const float* input, const float* cache, float* grad_output, float* grad_input,
+                           size_t rows, size_t width) const = 0;
+    // Обратный проход обучения по буферам SIREN::trainStep: то же, что backward, но без выделения памяти.
+    // Прибавляет градиенты параметров к param_grads — участку слоя в буфере градиентов (в том же порядке,
+    // что параметры), поэтому несколько нитей могут считать его одновременно, каждая в свой буфер.
+    // grad_input == nullptr — градиент по входу не нужен
+    virtual void trainGrad(const float* input, const float* cache, float* grad_output, float* grad_input,
+                           size_t rows, size_t width, float* param_grads) const = 0;
+
+    // Параметры всех слоёв лежат подряд в общих буферах SIREN, слой получает свой участок
+    virtual size_t numParams() const { return 0; }
+    virtual void bindParams(float* params, float* grads) {}
+    virtual void initParams(RandomStream& rng) {}
 };
 
 
 class DenseLayer : public Layer {
 public:
-    Matrix weights, biases;
-    float learning_rate = 0.00005f, beta1 = 0.9, beta2 = 0.999, epsilon = 1e-8, beta1_t = beta1, beta2_t = beta2;
-    Matrix m_weights, v_weights;
-    Matrix m_biases, v_biases;
+    size_t input_size, output_size;
+    MatrixView weights, biases;
+    MatrixView grad_weights, grad_biases;
     Matrix input_cache;
 
-    DenseLayer(size_t input_size, size_t output_size) : weights(output_size, input_size), biases(1, output_size),
-               m_weights(output_size, input_size), v_weights(output_size, input_size), m_biases(1, output_size), 
-               v_biases(1, output_size) 
-    {
-        std::random_device rd;
-        std::mt19937 gen(rd());
+    DenseLayer(size_t input_size, size_t output_size) : input_size(input_size), output_size(output_size) {}
+
+    size_t numParams() const override {
+        return output_size * input_size + output_size;
+    }
+
+    // Порядок как в файле весов: сначала матрица весов, затем смещения
+    void bindParams(float* params, float* grads) override {
+        weights = MatrixView(params, output_size, input_size);
+        biases = MatrixView(params + weights.size(), 1, output_size);
+        grad_weights = MatrixView(grads, output_size, input_size);
+        grad_biases = MatrixView(grads + weights.size(), 1, output_size);
+    }
+
+    void initParams(RandomStream& rng) override {
         float w0 = 30; // Значение w0 для SIREN
         float limit = std::sqrt(6.0 / input_size) / w0;
 
-        std::uniform_real_distribution<float> distribution(-limit, limit);
-
         // Инициализация весов
         for (size_t i = 0; i < weights.rows; ++i) {
             for (size_t j = 0; j < weights.cols; ++j) {
-                weights(i, j) = distribution(gen);
+                weights(i, j) = rng.uniform(-limit, limit);
             }
         }
 
@@ -51,33 +88,6 @@ public:
                 biases(i, j) = 0.0; // Можете выбрать другое значение для инициализации смещений, если это необходимо
             }
         }
-               
-    }
-
-    void loadWeights(std::ifstream& file) {
-        for (size_t i = 0; i < weights.rows; ++i) {
-            for (size_t j = 0; j < weights.cols; ++j) {
-                file.read(reinterpret_cast<char*>(&weights(i, j)), sizeof(float));
-            }
-        }
-        for (size_t i = 0; i < biases.rows; ++i) {
-            for (size_t j = 0; j < biases.cols; ++j) {
-                file.read(reinterpret_cast<char*>(&biases(i, j)), sizeof(float));
-            }
-        }
-    }
-
-    void saveWeights(std::ofstream& file) {
-        for (size_t i = 0; i < weights.rows; ++i) {
-            for (size_t j = 0; j < weights.cols; ++j) {
-                file.write(reinterpret_cast<const char*>(&weights(i, j)), sizeof(float));
-            }
-        }
-        for (size_t i = 0; i < biases.rows; ++i) {
-            for (size_t j = 0; j < biases.cols; ++j) {
-                file.write(reinterpret_cast<const char*>(&biases(i, j)), sizeof(float));
-            }
-        }
     }
 
     void printWeights() const override {
@@ -92,63 +102,132 @@ public:
         }
     }
 
-    void setLR(const float& lr) {
-        learning_rate = lr;
+    size_t outputWidth(size_t input_width) const override {
+        return output_size;
+    }
+
+    // Смещение добавляется в эпилоге GEMM, отдельного прохода по выходу нет
+    void infer(const float* input, float* output, float* cache, size_t rows, size_t width) const override {
+        assert(width == input_size);
+        gemm::Epilogue epilogue;
+        epilogue.bias = biases.data;
+        gemm::sgemm(gemm::Op::N, gemm::Op::T, rows, output_size, input_size,
+                    input, input_size, weights.data, weights.cols, output, output_size, false, &epilogue);
+    }
+
+    void inferGrad(const float* input, const float* cache, float* grad_output, float* grad_input,
+                   size_t rows, size_t width) const override {
+        gemm::sgemm(gemm::Op::N, gemm::Op::N, rows, input_size, output_size,
+                    grad_output, output_size, weights.data, weights.cols, grad_input, input_size);
     }
 
     Matrix forward(const Matrix& input) {
         input_cache = input;
-        Matrix output = Matrix::multiply(input, Matrix::transpose(weights));
+        Matrix output(input.rows, output_size);
+        gemm::Epilogue epilogue;
+        epilogue.bias = biases.data;
+        gemm::sgemm(gemm::Op::N, gemm::Op::T, input.rows, output_size, input_size,
+                    input.data.data(), input.cols, weights.data, weights.cols, output.data.data(), output.cols,
+                    false, &epilogue);
+        return output;
+    }
 
-        #pragma omp parallel for
-        for (int i = 0; i < output.rows; ++i) {
-            for (int j = 0; j < output.cols; ++j) {
-                output(i, j) += biases.data[j];
+    Matrix backward(const Matrix& grad) {
+        Matrix dInput(grad.rows, input_size);
+        accumulateGrads(input_cache.data.data(), grad.data.data(), dInput.data.data(), grad.rows, grad_weights.data);
+        return dInput;
+    }
+
+    void trainGrad(const float* input, const float* cache, float* grad_output, float* grad_input,
+                   size_t rows, size_t width, float* param_grads) const override {
+        accumulateGrads(input, grad_output, grad_input, rows, param_grads);
+    }
+
+protected:
+    // param_grads — градиенты весов, за ними градиенты смещений (как grad_weights и grad_biases)
+    void accumulateGrads(const float* input, const float* grad_output, float* grad_input, size_t rows,
+                         float* param_grads) const {
+        float* grad_b = param_grads + output_size * input_size;
+        gemm::sgemm(gemm::Op::T, gemm::Op::N, output_size, input_size, rows,
+                    grad_output, output_size, input, input_size,
+                    param_grads, input_size, true);
+
+        for (size_t i = 0; i < rows; ++i) {
+            for (size_t j = 0; j < output_size; ++j) {
+                grad_b[j] += grad_output[i * output_size + j];
             }
         }
-        return output;
-    }
 
-    void updateWeights(const Matrix& dW, const Matrix& db) {
-        // Обновление моментов для весов
-        m_weights = m_weights * beta1 + dW * (1 - beta1);
-        v_weights = v_weights * beta2 + (dW * dW) * (1 - beta2); // Предполагаем, что операция ^ выполняет поэлементное возведение в квадрат
+        if (grad_input) {
+            gemm::sgemm(gemm::Op::N, gemm::Op::N, rows, input_size, output_size,
+                        grad_output, output_size, weights.data, weights.cols, grad_input, input_size);
+        }
+    }
+};
 
-        // Исправление смещения для моментов
-        Matrix m_hat_weights = m_weights / (1 - beta1_t);
-        Matrix v_hat_weights = v_weights / (1 - beta2_t);
 
-        // Обновление весов
-        weights = weights - (m_hat_weights / (v_hat_weights.sqrt() + epsilon)) * learning_rate;
+// Dense и следующий за ним Sin одним слоем: смещение, умножение на w0 и sin применяются
+// в эпилоге GEMM, пока тайл результата в кэше, вместо четырёх проходов по активациям.
+// Для обратного прохода там же сохраняется cos, пересчитывать его не нужно
+class DenseSineLayer : public DenseLayer {
+public:
+    float w0;
+    Matrix cos_cache;
 
-        // Похожие шаги для смещений
-        m_biases = m_biases * beta1 + db * (1 - beta1);
-        v_biases = v_biases * beta2 + (db * db) * (1 - beta2);
+    DenseSineLayer(size_t input_size, size_t output_size, float w0 = 30.0) : DenseLayer(input_size, output_size), w0(w0) {}
 
-        Matrix m_hat_biases = m_biases / (1 - beta1_t);
-        Matrix v_hat_biases = v_biases / (1 - beta2_t);
+    size_t cacheWidth(size_t input_width) const override {
+        return output_size;
+    }
 
-        biases = biases - (m_hat_biases / (v_hat_biases.sqrt() + epsilon)) * learning_rate;
+    void infer(const float* input, float* output, float* cache, size_t rows, size_t width) const override {
+        assert(width == input_size);
+        gemm::Epilogue epilogue;
+        epilogue.bias = biases.data;
+        epilogue.scale = w0;
+        epilogue.sine = true;
+        epilogue.cos_out = cache;
+        gemm::sgemm(gemm::Op::N, gemm::Op::T, rows, output_size, input_size,
+                    input, input_size, weights.data, weights.cols, output, output_size, false, &epilogue);
+    }
 
-        beta1_t *= beta1;
-        beta2_t *= beta2;
+    // cache — cos(w0 * z) из infer, градиент по z считается на месте grad_output
+    void inferGrad(const float* input, const float* cache, float* grad_output, float* grad_input,
+                   size_t rows, size_t width) const override {
+        for (size_t i = 0; i < rows * output_size; ++i) {
+            grad_output[i] *= w0 * cache[i];
+        }
+        DenseLayer::inferGrad(input, nullptr, grad_output, grad_input, rows, width);
     }
 
-    Matrix backward(const Matrix& grad) {
-        Matrix dW = Matrix::multiply(Matrix::transpose(grad), input_cache);
+    Matrix forward(const Matrix& input) override {
+        input_cache = input;
+        Matrix output(input.rows, output_size);
+        cos_cache = Matrix(input.rows, output_size);
+        infer(input.data.data(), output.data.data(), cos_cache.data.data(), input.rows, input.cols);
+        return output;
+    }
 
-        Matrix db(biases.rows, biases.cols);
-        for (int j = 0; j < grad.cols; ++j) {
+    Matrix backward(const Matrix& grad) override {
+        Matrix grad_z(grad.rows, grad.cols);
 
-            #pragma omp parallel for
-            for (int i = 0; i < grad.rows; ++i) {
-                db.data[j] += grad(i, j);
+        parallelFor(grad.data.size(), ELEMENTWISE_POLICY, [&](size_t begin, size_t end, int) {
+            for (size_t i = begin; i < end; ++i) {
+                grad_z.data[i] = grad.data[i] * w0 * cos_cache.data[i];
             }
-        }
+        });
+        return DenseLayer::backward(grad_z);
+    }
 
-        updateWeights(dW, db);
-        Matrix dInput = Matrix::multiply(grad, weights);
-        return dInput;
+    // Градиент по z — на месте grad_output, в том же порядке операций, что в backward
+    void trainGrad(const float* input, const float* cache, float* grad_output, float* grad_input,
+                   size_t rows, size_t width, float* param_grads) const override {
+        parallelFor(rows * output_size, ELEMENTWISE_POLICY, [&](size_t begin, size_t end, int) {
+            for (size_t i = begin; i < end; ++i) {
+                grad_output[i] = grad_output[i] * w0 * cache[i];
+            }
+        });
+        accumulateGrads(input, grad_output, grad_input, rows, param_grads);
     }
 };
 
@@ -160,32 +239,60 @@ private:
 
 public:
     SineLayer(float w0 = 30.0) : w0(w0) {}
-    void loadWeights(std::ifstream& file) {}
     void printWeights() const override {}
-    void saveWeights(std::ofstream& file) {}
-    void setLR(const float& lr) {}
+
+    void infer(const float* input, float* output, float* cache, size_t rows, size_t width) const override {
+        parallelFor(rows * width, TRANSCENDENTAL_POLICY, [&](size_t begin, size_t end, int) {
+            for (size_t i = begin; i < end; ++i) {
+                output[i] = std::sin(w0 * input[i]);
+            }
+        });
+    }
+
+    void inferGrad(const float* input, const float* cache, float* grad_output, float* grad_input,
+                   size_t rows, size_t width) const override {
+        parallelFor(rows * width, TRANSCENDENTAL_POLICY, [&](size_t begin, size_t end, int) {
+            for (size_t i = begin; i < end; ++i) {
+                grad_input[i] = grad_output[i] * w0 * std::cos(w0 * input[i]);
+            }
+        });
+    }
 
     Matrix forward(const Matrix& input) override {
         Matrix prod = input * w0;
         prod_cache = prod;
         Matrix output(input.rows, input.cols); // Создаём выходную матрицу такого же размера, как и входная
         
-        #pragma omp parallel for
-        for (size_t i = 0; i < input.data.size(); ++i) {
-            output.data[i] = std::sin(prod.data[i]);
-        }
+        parallelFor(input.data.size(), TRANSCENDENTAL_POLICY, [&](size_t begin, size_t end, int) {
+            for (size_t i = begin; i < end; ++i) {
+                output.data[i] = std::sin(prod.data[i]);
+            }
+        });
         return output;
     }
 
     Matrix backward(const Matrix& grad) {
         Matrix dSine_dInput(prod_cache.rows, prod_cache.cols);
         
-        #pragma omp parallel for
-        for (size_t i = 0; i < prod_cache.data.size(); ++i) {
-            dSine_dInput.data[i] = w0 * std::cos(prod_cache.data[i]);
-        }
+        parallelFor(prod_cache.data.size(), TRANSCENDENTAL_POLICY, [&](size_t begin, size_t end, int) {
+            for (size_t i = begin; i < end; ++i) {
+                dSine_dInput.data[i] = w0 * std::cos(prod_cache.data[i]);
+            }
+        });
         return dSine_dInput * grad;
     }
+
+    void trainGrad(const float* input, const float* cache, float* grad_output, float* grad_input,
+                   size_t rows, size_t width, float* param_grads) const override {
+        if (!grad_input) {
+            return;
+        }
+        parallelFor(rows * width, TRANSCENDENTAL_POLICY, [&](size_t begin, size_t end, int) {
+            for (size_t i = begin; i < end; ++i) {
+                grad_input[i] = w0 * std::cos(input[i] * w0) * grad_output[i];
+            }
+        });
+    }
 };
 
 
@@ -209,13 +316,94 @@ public:
 };
 
 
+// Рабочая память для SIREN::forward без кэшей обучения, inputGradient и trainStep. У каждой нити должна быть своя
+struct InferenceWorkspace {
+    AlignedBuffer ping, pong;
+    // Выходы всех слоёв подряд — нужны только для SIREN::inputGradient
+    AlignedBuffer activations;
+
+    void reserve(size_t size) {
+        if (ping.size() < size) {
+            ping.resize(size);
+            pong.resize(size);
+        }
+    }
+
+    void reserveActivations(size_t size) {
+        if (activations.size() < size) {
+            activations.resize(size);
+        }
+    }
+};
+
+
 class SIREN {
 private:
     std::vector<Layer*> layers;
+    // Параметры лежат либо в своём буфере params, либо прямо в отображённом файле весов v2 (mapped)
+    AlignedBuffer params, grads;
+    float* param_data = nullptr;
+    size_t num_params = 0;
+    std::unique_ptr<WeightsFile> mapped;
+    // Файл весов v2, из которого конструктор взял архитектуру: loadWeights того же файла
+    // использует это отображение, а не открывает и не проверяет файл заново
+    std::unique_ptr<WeightsFile> arch_file;
+    std::string arch_file_name;
+    // Текст arch.txt, из которого собрана сеть; записывается в файл весов
+    std::string arch;
+    bool fused = true;
+    std::unique_ptr<Optimizer> optimizer;
+    size_t input_width = 0, output_width = 0, max_width = 0, activations_width = 0;
+    // layer_widths[l] — ширина входа слоя l, последний элемент — ширина выхода сети
+    std::vector<size_t> layer_widths;
+    // Смещения (в числах на строку батча) выходов и кэшей слоёв в InferenceWorkspace::activations
+    std::vector<size_t> slot_offsets;
+    // Начало параметров слоя l в буфере параметров (и градиентов)
+    std::vector<size_t> param_offsets;
+    // Суммы квадратов градиентов по блокам GRAD_NORM_BLOCK для gradNorm
+    mutable std::vector<double> norm_partials;
+
+    static constexpr size_t GRAD_NORM_BLOCK = 4096;
 
 public:
-    SIREN(const std::string& filename) {
-        std::ifstream file(filename);
+    // При fuse_layers = true пары Dense -> Sin собираются в один DenseSineLayer
+    // filename — arch.txt или файл весов v2, в котором архитектура записана вместе с весами
+    SIREN(const std::string& filename, bool fuse_layers = true) : optimizer(new Adam()) {
+        if (isWeightsV2File(filename)) {
+            arch_file.reset(new WeightsFile(filename, true));
+            arch_file_name = filename;
+            build(arch_file->arch(), fuse_layers);
+        } else {
+            build(readText(filename), fuse_layers);
+        }
+        initParams(0);
+    }
+
+    ~SIREN() {
+        for (Layer* layer : layers) {
+            delete layer;
+        }
+    }
+
+    SIREN(const SIREN&) = delete;
+    SIREN& operator=(const SIREN&) = delete;
+
+    // Независимая копия сети с текущими параметрами в своём буфере, без состояния оптимизатора:
+    // её можно рендерить в другой нити, пока обучение меняет оригинал
+    std::unique_ptr<SIREN> snapshot() const {
+        std::unique_ptr<SIREN> copy(new SIREN());
+        copy->build(arch, fused);
+        std::memcpy(copy->param_data, param_data, num_params * sizeof(float));
+        return copy;
+    }
+
+private:
+    SIREN() : optimizer(new Adam()) {}
+
+    void build(const std::string& text, bool fuse_layers) {
+        arch = text;
+        fused = fuse_layers;
+        std::istringstream file(arch);
         std::string line;
         while (std::getline(file, line)) {
             std::istringstream iss(line);
@@ -231,38 +419,130 @@ public:
                 iss.ignore(std::numeric_limits<std::streamsize>::max(), '(');
                 iss >> outputSize;
 
+                if (layers.empty()) {
+                    input_width = inputSize;
+                }
                 layers.push_back(new DenseLayer(inputSize, outputSize));
             } else if (layerType == "Sin") {
                 float w0 = 30.0;
-                layers.push_back(new SineLayer(w0));
+                DenseLayer* dense = layers.empty() ? nullptr : dynamic_cast<DenseLayer*>(layers.back());
+                if (fuse_layers && dense && !dynamic_cast<DenseSineLayer*>(dense)) {
+                    layers.back() = new DenseSineLayer(dense->input_size, dense->output_size, w0);
+                    delete dense;
+                } else {
+                    layers.push_back(new SineLayer(w0));
+                }
             }
         }
-        file.close();
-    }
 
-    ~SIREN() {
         for (Layer* layer : layers) {
-            delete layer;
+            param_offsets.push_back(num_params);
+            num_params += layer->numParams();
+        }
+        params.resize(num_params);
+        grads.resize(num_params);
+        norm_partials.assign((num_params + GRAD_NORM_BLOCK - 1) / GRAD_NORM_BLOCK, 0.0);
+        bindParams(params.data());
+
+        output_width = max_width = input_width;
+        layer_widths.push_back(input_width);
+        for (Layer* layer : layers) {
+            size_t cache_width = layer->cacheWidth(output_width);
+            output_width = layer->outputWidth(output_width);
+            max_width = std::max(max_width, output_width);
+            layer_widths.push_back(output_width);
+            slot_offsets.push_back(activations_width);
+            activations_width += output_width + cache_width;
         }
     }
 
-    void loadWeights(const std::string& filename) {
-        std::ifstream weightsFile(filename, std::ios::binary);
-        for (auto layer : layers) {
-            layer->loadWeights(weightsFile);
+public:
+
+    // Слой l получает свой поток (seed, Init, l): одинаковый seed — одинаковые начальные веса
+    void initParams(uint64_t seed) {
+        for (size_t l = 0; l < layers.size(); ++l) {
+            RandomStream rng(seed, randomStream(RandomPurpose::Init, l));
+            layers[l]->initParams(rng);
         }
-        return;
     }
 
-    void saveWeights(const std::string& filename) {
-        std::ofstream weightsFile(filename, std::ios::binary | std::ios::out);
-        if (!weightsFile) {
-            throw std::runtime_error("Не удалось открыть файл для записи весов: " + filename);
+    // Файл v2 отображается в память copy-on-write, и слои считают прямо по нему без копирования:
+    // процессы рендера с одними весами делят одну копию в кэше ОС. Если в файле есть состояние
+    // оптимизатора с теми же именами, оно восстанавливается. Файл старого формата — только параметры
+    // подряд без заголовка — копируется в свой буфер. В обоих случаях файл должен подходить к архитектуре.
+    // С with_optimizer (продолжение обучения) в файле обязано быть всё состояние текущего оптимизатора
+    void loadWeights(const std::string& filename, bool with_optimizer = false) {
+        std::unique_ptr<WeightsFile> file;
+        if (arch_file && arch_file_name == filename) {
+            file = std::move(arch_file);
+        }
+        arch_file.reset();
+
+        bool v2 = file != nullptr;
+        if (!v2) {
+            MappedFile probe(filename);
+            v2 = isWeightsV2(probe.data(), probe.size());
+            if (!v2) {
+                size_t expected = num_params * sizeof(float);
+                if (probe.size() != expected) {
+                    throw std::runtime_error("Размер файла весов " + filename + " не совпадает с архитектурой: ожидалось " +
+                                             std::to_string(expected) + " байт, в файле " + std::to_string(probe.size()));
+                }
+                ownParams();
+                std::memcpy(param_data, probe.data(), expected);
+            }
+        }
+        if (!v2 && with_optimizer) {
+            throw std::runtime_error("В файле весов " + filename + " старого формата нет состояния оптимизатора");
+        }
+        if (!v2) {
+            return;
         }
 
-        for (auto layer : layers) {
-            layer->saveWeights(weightsFile);
+        if (!file) {
+            file.reset(new WeightsFile(filename, true));
+        }
+        if (archSignature(file->arch()) != archSignature(arch)) {
+            throw std::runtime_error("Архитектура в файле весов " + filename + " не совпадает с архитектурой модели");
         }
+        size_t count;
+        float* data = file->tensor("params", count);
+        if (!data || count != num_params) {
+            throw std::runtime_error("В файле весов " + filename + " нет параметров нужного размера");
+        }
+
+        // Кроме params в файле что-то есть — значит, сохранено состояние оптимизатора
+        if (with_optimizer || file->numTensors() > 1) {
+            size_t state_count;
+            for (const OptimizerState& st : optimizer->state(num_params)) {
+                const float* saved = file->tensor(st.name, state_count);
+                if (saved && state_count == st.size) {
+                    std::memcpy(st.data, saved, st.size * sizeof(float));
+                } else if (with_optimizer) {
+                    // Частично восстановленный оптимизатор молча разошёлся бы с непрерывным обучением
+                    throw std::runtime_error("В файле " + filename + " нет состояния оптимизатора " + st.name +
+                                             (saved ? " нужного размера" : "") +
+                                             ": чекпоинт сохранён с другим optimizer или другой моделью");
+                }
+            }
+        }
+
+        bindParams(data);
+        mapped = std::move(file);
+        params.resize(0);
+    }
+
+    // Формат v2. С with_optimizer сохраняется и состояние оптимизатора, чтобы продолжить обучение,
+    // extra — дополнительные тензоры вызывающего (например, состояние цикла обучения)
+    void saveWeights(const std::string& filename, bool with_optimizer = false,
+                     const std::vector<WeightsTensorData>& extra = {}) {
+        writeWeightsFile(filename, arch, weightTensors(with_optimizer, extra));
+    }
+
+    // То же содержимое, что записал бы saveWeights, но скопированное сейчас: записать его можно позже
+    // и из другой нити, пока обучение продолжается
+    WeightsSnapshot snapshotWeights(bool with_optimizer = false, const std::vector<WeightsTensorData>& extra = {}) {
+        return WeightsSnapshot(arch, weightTensors(with_optimizer, extra));
     }
 
 
@@ -274,10 +554,127 @@ public:
         }
     }
 
+    size_t numParams() const { return num_params; }
+    float* parameters() { return param_data; }
+    const float* parameters() const { return param_data; }
+    float* gradients() { return grads.data(); }
+    const float* gradients() const { return grads.data(); }
+
+    void setOptimizer(std::unique_ptr<Optimizer> opt) {
+        optimizer = std::move(opt);
+    }
+
     void setLR(const float& lr) {
-        for (auto layer : layers) {
-            layer->setLR(lr);
+        optimizer->setLR(lr);
+    }
+
+    size_t inputWidth() const { return input_width; }
+    size_t outputWidth() const { return output_width; }
+
+    // Реентерабельный инференс: input (rows x inputWidth) -> rows x outputWidth внутри ws.
+    // Не трогает кэши слоёв, поэтому render и запросы точек могут звать его из всех нитей сразу
+    const float* forward(const float* input, size_t rows, InferenceWorkspace& ws) const {
+        ws.reserve(rows * max_width);
+        const float* current = input;
+        for (size_t l = 0; l < layers.size(); ++l) {
+            float* output = (current == ws.ping.data()) ? ws.pong.data() : ws.ping.data();
+            layers[l]->infer(current, output, nullptr, rows, layer_widths[l]);
+            current = output;
+        }
+        return current;
+    }
+
+    // Градиент выхода по входным точкам (для SDF — ненормированная нормаль): прямой проход
+    // с сохранением выходов слоёв и один обратный. Возвращает rows x inputWidth внутри ws,
+    // если values не nullptr, туда записывается указатель на значения сети (rows x outputWidth)
+    const float* inputGradient(const float* input, size_t rows, InferenceWorkspace& ws,
+                               const float** values = nullptr) const {
+        ws.reserve(rows * max_width);
+        ws.reserveActivations(rows * activations_width);
+
+        // Слот слоя l в activations: его выход (rows x layer_widths[l + 1]), затем его кэш
+        const float* current = input;
+        for (size_t l = 0; l < layers.size(); ++l) {
+            float* output = ws.activations.data() + rows * slot_offsets[l];
+            float* cache = output + rows * layer_widths[l + 1];
+            layers[l]->infer(current, output, cache, rows, layer_widths[l]);
+            current = output;
+        }
+        if (values) {
+            *values = current;
+        }
+
+        float* grad = ws.ping.data();
+        std::fill(grad, grad + rows * output_width, 1.0f);
+        for (size_t l = layers.size(); l-- > 0;) {
+            const float* output = ws.activations.data() + rows * slot_offsets[l];
+            const float* cache = output + rows * layer_widths[l + 1];
+            const float* layer_input = l == 0 ? input : ws.activations.data() + rows * slot_offsets[l - 1];
+            float* grad_input = (grad == ws.ping.data()) ? ws.pong.data() : ws.ping.data();
+            layers[l]->inferGrad(layer_input, cache, grad, grad_input, rows, layer_widths[l]);
+            grad = grad_input;
         }
+        return grad;
+    }
+
+    // Выделяет в ws всю память для батчей до rows строк: после этого forward, inputGradient
+    // и trainStep с таким числом строк память не выделяют
+    void reserve(size_t rows, InferenceWorkspace& ws) const {
+        ws.reserve(rows * max_width);
+        ws.reserveActivations(rows * activations_width);
+    }
+
+    // Шаг обучения по батчу x (rows x inputWidth) с ответами y (rows x outputWidth) без выделения памяти:
+    // прямой проход с выходами слоёв в ws, MSE и обратный проход, который прибавляет градиенты параметров
+    // к буферу градиентов. Возвращает MSE. Порядок операций тот же, что у forward + MSE + backward на Matrix,
+    // поэтому результат совпадает с ними бит в бит
+    float trainStep(const float* x, const float* y, size_t rows, InferenceWorkspace& ws) {
+        return trainStep(x, y, rows, ws, grads.data(), rows);
+    }
+
+    // То же для части батча из total_rows строк: MSE и её градиент нормируются на весь батч, а градиенты
+    // прибавляются к param_grads (numParams() чисел). Сумма результатов по частям — шаг по всему батчу.
+    // Параметры только читаются, поэтому части можно считать в разных нитях, у каждой свои ws и param_grads
+    float trainStep(const float* x, const float* y, size_t rows, InferenceWorkspace& ws,
+                    float* param_grads, size_t total_rows) const {
+        reserve(rows, ws);
+
+        const float* current = x;
+        for (size_t l = 0; l < layers.size(); ++l) {
+            float* output = ws.activations.data() + rows * slot_offsets[l];
+            float* cache = output + rows * layer_widths[l + 1];
+            layers[l]->infer(current, output, cache, rows, layer_widths[l]);
+            current = output;
+        }
+
+        size_t n = rows * output_width;
+        float N = static_cast<float>(total_rows * output_width);
+        float* grad = ws.ping.data();
+        float sum = 0.0f;
+        for (size_t i = 0; i < n; ++i) {
+            float diff = current[i] - y[i];
+            sum += diff * diff;
+            grad[i] = diff * (2.0f / N);
+        }
+
+        for (size_t l = layers.size(); l-- > 0;) {
+            const float* output = ws.activations.data() + rows * slot_offsets[l];
+            const float* cache = output + rows * layer_widths[l + 1];
+            const float* layer_input = l == 0 ? x : ws.activations.data() + rows * slot_offsets[l - 1];
+            float* grad_input = l == 0 ? nullptr : (grad == ws.ping.data()) ? ws.pong.data() : ws.ping.data();
+            layers[l]->trainGrad(layer_input, cache, grad, grad_input, rows, layer_widths[l],
+                                 param_grads + param_offsets[l]);
+            grad = grad_input;
+        }
+        return sum / N;
+    }
+
+    Matrix forward(const Matrix& input, InferenceWorkspace& ws) const {
+        assert(input.cols == input_width);
+        const float* result = forward(input.data.data(), input.rows, ws);
+        Matrix output(input.rows, output_width);
+        std::copy(result, result + output.data.size(), output.data.begin());
+        return output;
     }
 
     Matrix forward(const Matrix& input) {
@@ -288,11 +685,131 @@ public:
         return output;
     }
 
+    // Накапливает градиенты параметров в буфере градиентов, веса не меняет.
+    // Несколько вызовов подряд суммируют градиенты микробатчей
     Matrix backward(const Matrix& grad) {
         auto layer_grad = grad;
         for (auto it = layers.rbegin(); it != layers.rend(); ++it) {
-            layer_grad = (*it)->backward(layer_grad); // Обновляем grad на каждом шаге
+            layer_grad = (*it)->backward(layer_grad);
         }
         return layer_grad;
     }
-};
+
+    void zeroGrad() {
+        grads.zero();
+    }
+
+    void scaleGrad(float scale) {
+        float* g = grads.data();
+        parallelFor(grads.size(), OPTIMIZER_POLICY, [&](size_t begin, size_t end, int) {
+            #pragma omp simd
+            for (size_t i = begin; i < end; ++i) {
+                g[i] *= scale;
+            }
+        });
+    }
+
+    // Суммы по блокам фиксированного размера складываются по порядку, поэтому норма не зависит
+    // ни от числа нитей, ни от SIREN_PARALLEL_BACKEND
+    float gradNorm() const {
+        const float* g = grads.data();
+        size_t n = grads.size();
+        int threads = OPTIMIZER_POLICY.parallel(n) ? parallelWorkers() : 1;
+        parallelFor(norm_partials.size(), threads, [&](size_t begin, size_t end, int) {
+            for (size_t b = begin; b < end; ++b) {
+                double sum = 0.0;
+                size_t last = std::min(n, (b + 1) * GRAD_NORM_BLOCK);
+                #pragma omp simd reduction(+ : sum)
+                for (size_t i = b * GRAD_NORM_BLOCK; i < last; ++i) {
+                    sum += double(g[i]) * g[i];
+                }
+                norm_partials[b] = sum;
+            }
+        });
+
+        double sum = 0.0;
+        for (double part : norm_partials) {
+            sum += part;
+        }
+        return static_cast<float>(std::sqrt(sum));
+    }
+
+    // Масштабирует градиенты так, чтобы их L2-норма не превышала max_norm. Возвращает норму до обрезки
+    float clipGradNorm(float max_norm) {
+        float norm = gradNorm();
+        if (norm > max_norm) {
+            scaleGrad(max_norm / (norm + 1e-6f));
+        }
+        return norm;
+    }
+
+    // Применяет накопленные градиенты: один шаг оптимизатора по всему буферу параметров
+    void step() {
+        optimizer->step(param_data, grads.data(), num_params);
+    }
+
+private:
+    std::vector<WeightsTensorData> weightTensors(bool with_optimizer, const std::vector<WeightsTensorData>& extra) {
+        std::vector<WeightsTensorData> tensors = {{"params", param_data, num_params}};
+        if (with_optimizer) {
+            for (const OptimizerState& st : optimizer->state(num_params)) {
+                tensors.push_back({st.name, st.data, st.size});
+            }
+        }
+        tensors.insert(tensors.end(), extra.begin(), extra.end());
+        return tensors;
+    }
+
+    void bindParams(float* data) {
+        param_data = data;
+        size_t offset = 0;
+        for (Layer* layer : layers) {
+            layer->bindParams(param_data + offset, grads.data() + offset);
+            offset += layer->numParams();
+        }
+    }
+
+    // Вернуть параметры из отображённого файла в свой буфер
+    void ownParams() {
+        if (mapped) {
+            params.resize(num_params);
+            std::memcpy(params.data(), param_data, num_params * sizeof(float));
+            bindParams(params.data());
+            mapped.reset();
+        }
+    }
+
+    static std::string readText(const std::string& filename) {
+        std::ifstream file(filename, std::ios::binary);
+        return std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    }
+
+    // Типы слоёв и размеры без остального текста: по ней сравниваются архитектуры
+    static std::string archSignature(const std::string& text) {
+        std::istringstream lines(text);
+        std::string line, signature;
+        while (std::getline(lines, line)) {
+            std::istringstream iss(line);
+            std::string type;
+            if (!(iss >> type)) {
+                continue;
+            }
+            signature += type;
+            size_t i = 0;
+            while (i < line.size()) {
+                if (!std::isdigit(static_cast<unsigned char>(line[i]))) {
+                    ++i;
+                    continue;
+                }
+                size_t end = i;
+                while (end < line.size() && std::isdigit(static_cast<unsigned char>(line[end]))) {
+                    ++end;
+                }
+                signature += " " + line.substr(i, end - i);
+                i = end;
+            }
+            signature += ';';
+        }
+        return signature;
+    }
+};
\ No newline at end of file
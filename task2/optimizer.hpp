@@ -0,0 +1,126 @@
+#pragma once
+#include "matrix.hpp"
+#include <cmath>
+#include <cstddef>
+#include <omp.h>
+#include <string>
+#include <vector>
+
+
+// Меньше этого числа параметров параллельный регион не окупается
+const ParallelPolicy OPTIMIZER_POLICY = {16384, false};
+
+
+// Один проход Adam: моменты m, v и веса w обновляются на месте, без временных матриц.
+// beta1_t, beta2_t — степени beta1, beta2 для текущего шага (поправка смещения).
+inline void adamStep(float* w, const float* g, float* m, float* v, size_t n,
+                     float lr, float beta1, float beta2, float epsilon, float beta1_t, float beta2_t) {
+    const float c1 = 1.0f / (1.0f - beta1_t);
+    const float c2 = 1.0f / (1.0f - beta2_t);
+
+    parallelFor(n, OPTIMIZER_POLICY, [&](size_t begin, size_t end, int) {
+        #pragma omp simd
+        for (size_t i = begin; i < end; ++i) {
+            float gi = g[i];
+            float mi = beta1 * m[i] + (1.0f - beta1) * gi;
+            float vi = beta2 * v[i] + (1.0f - beta2) * gi * gi;
+            m[i] = mi;
+            v[i] = vi;
+            w[i] -= lr * (mi * c1) / (std::sqrt(vi * c2) + epsilon);
+        }
+    });
+}
+
+
+// SGD с моментом: скорость и веса обновляются на месте за один проход
+inline void sgdMomentumStep(float* w, const float* g, float* velocity, size_t n, float lr, float momentum) {
+    parallelFor(n, OPTIMIZER_POLICY, [&](size_t begin, size_t end, int) {
+        #pragma omp simd
+        for (size_t i = begin; i < end; ++i) {
+            float vi = momentum * velocity[i] + g[i];
+            velocity[i] = vi;
+            w[i] -= lr * vi;
+        }
+    });
+}
+
+
+// Именованный участок состояния оптимизатора, который сохраняется вместе с весами
+struct OptimizerState {
+    std::string name;
+    float* data;
+    size_t size;
+};
+
+
+// Оптимизатор шагает сразу по всему плоскому буферу параметров модели
+class Optimizer {
+public:
+    virtual ~Optimizer() {}
+    virtual void step(float* params, const float* grads, size_t n) = 0;
+    virtual void setLR(float lr) = 0;
+    // Всё состояние для модели из n параметров; буферы выделяются, если шагов ещё не было.
+    // Записи в data меняют сам оптимизатор, так состояние и восстанавливается
+    virtual std::vector<OptimizerState> state(size_t n) = 0;
+};
+
+
+class Adam : public Optimizer {
+public:
+    float learning_rate, beta1, beta2, epsilon, beta1_t, beta2_t;
+    AlignedBuffer m, v;
+
+    Adam(float lr = 0.00005f, float beta1 = 0.9f, float beta2 = 0.999f, float epsilon = 1e-8f)
+        : learning_rate(lr), beta1(beta1), beta2(beta2), epsilon(epsilon), beta1_t(beta1), beta2_t(beta2) {}
+
+    void step(float* params, const float* grads, size_t n) override {
+        if (m.size() != n) {
+            m.resize(n);
+            v.resize(n);
+        }
+        adamStep(params, grads, m.data(), v.data(), n, learning_rate, beta1, beta2, epsilon, beta1_t, beta2_t);
+
+        beta1_t *= beta1;
+        beta2_t *= beta2;
+    }
+
+    void setLR(float lr) override {
+        learning_rate = lr;
+    }
+
+    std::vector<OptimizerState> state(size_t n) override {
+        if (m.size() != n) {
+            m.resize(n);
+            v.resize(n);
+        }
+        return {{"adam.m", m.data(), n}, {"adam.v", v.data(), n},
+                {"adam.beta1_t", &beta1_t, 1}, {"adam.beta2_t", &beta2_t, 1}};
+    }
+};
+
+
+class SGD : public Optimizer {
+public:
+    float learning_rate, momentum;
+    AlignedBuffer velocity;
+
+    SGD(float lr, float momentum = 0.9f) : learning_rate(lr), momentum(momentum) {}
+
+    void step(float* params, const float* grads, size_t n) override {
+        if (velocity.size() != n) {
+            velocity.resize(n);
+        }
+        sgdMomentumStep(params, grads, velocity.data(), n, learning_rate, momentum);
+    }
+
+    void setLR(float lr) override {
+        learning_rate = lr;
+    }
+
+    std::vector<OptimizerState> state(size_t n) override {
+        if (velocity.size() != n) {
+            velocity.resize(n);
+        }
+        return {{"sgd.velocity", velocity.data(), n}};
+    }
+};
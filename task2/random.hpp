@@ -0,0 +1,92 @@
+#pragma once
+#include <cstdint>
+#include <cmath>
+
+
+// Счётчиковый генератор Philox4x32-10 (Salmon et al., "Parallel Random Numbers: As Easy as 1, 2, 3").
+// Случайный блок — чистая функция от (ключ, счётчик), поэтому у каждой нити, точки или шага обучения
+// может быть свой независимый поток без общего состояния: результат не зависит от числа нитей
+// и расписания OpenMP, а запуск с тем же seed повторяется бит в бит
+inline void philox4x32(const uint32_t counter[4], const uint32_t key[2], uint32_t out[4]) {
+    const uint32_t M0 = 0xD2511F53u, M1 = 0xCD9E8D57u;
+    const uint32_t W0 = 0x9E3779B9u, W1 = 0xBB67AE85u;
+
+    uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+    uint32_t k0 = key[0], k1 = key[1];
+    for (int round = 0; round < 10; ++round) {
+        uint64_t p0 = static_cast<uint64_t>(M0) * c0;
+        uint64_t p1 = static_cast<uint64_t>(M1) * c2;
+        uint32_t n0 = static_cast<uint32_t>(p1 >> 32) ^ c1 ^ k0;
+        uint32_t n2 = static_cast<uint32_t>(p0 >> 32) ^ c3 ^ k1;
+        c0 = n0;
+        c1 = static_cast<uint32_t>(p1);
+        c2 = n2;
+        c3 = static_cast<uint32_t>(p0);
+        k0 += W0;
+        k1 += W1;
+    }
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+}
+
+
+// Назначение потока: старшие биты номера потока, чтобы потоки разных подсистем не пересекались
+enum class RandomPurpose : uint64_t {
+    Init = 1,    // инициализация весов, индекс — номер слоя
+    Samples = 2, // генерация обучающих точек, индекс — номер точки
+    Batch = 3,   // выбор батча, индекс — номер микробатча от начала обучения
+    Debug = 4
+};
+
+inline uint64_t randomStream(RandomPurpose purpose, uint64_t index) {
+    return (static_cast<uint64_t>(purpose) << 48) ^ index;
+}
+
+
+// Поток чисел (seed, stream): счётчик Philox = (номер блока, stream), ключ = seed.
+// Дёшево создаётся, поэтому поток заводится там, где нужен, а не передаётся между нитями
+class RandomStream {
+public:
+    RandomStream(uint64_t seed = 0, uint64_t stream = 0) : seed(seed), stream(stream), block(0), buffer(), used(4) {}
+
+    uint32_t next() {
+        if (used == 4) {
+            uint32_t counter[4] = {static_cast<uint32_t>(block), static_cast<uint32_t>(block >> 32),
+                                   static_cast<uint32_t>(stream), static_cast<uint32_t>(stream >> 32)};
+            uint32_t key[2] = {static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32)};
+            philox4x32(counter, key, buffer);
+            ++block;
+            used = 0;
+        }
+        return buffer[used++];
+    }
+
+    // [0, 1) с шагом 2^-24: все значения точно представимы во float
+    float uniform() {
+        return (next() >> 8) * (1.0f / 16777216.0f);
+    }
+
+    float uniform(float a, float b) {
+        return a + (b - a) * uniform();
+    }
+
+    // [0, n) умножением со сдвигом (Lemire); смещение порядка n / 2^32 для наших n несущественно
+    uint32_t below(uint32_t n) {
+        return static_cast<uint32_t>((static_cast<uint64_t>(next()) * n) >> 32);
+    }
+
+    // Стандартное нормальное, Бокс — Мюллер; второе значение пары не кэшируется, чтобы
+    // состояние потока оставалось (seed, stream, номер блока, позиция в блоке)
+    float normal() {
+        float u1 = 1.0f - uniform(); // (0, 1], чтобы не брать log(0)
+        float u2 = uniform();
+        return std::sqrt(-2.0f * std::log(u1)) * std::cos(6.283185307179586f * u2);
+    }
+
+private:
+    uint64_t seed, stream, block;
+    uint32_t buffer[4];
+    int used;
+};
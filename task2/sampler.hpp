@@ -0,0 +1,303 @@
+#pragma once
+#include "mesh.hpp"
+#include "hash.hpp"
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <filesystem>
+
+
+// Как выбираются обучающие точки. uniform — равномерно в кубе [-1, 1]^3.
+// surface — доля uniform_fraction равномерно, остальные у поверхности: точка, равномерная
+// по площади меша, плюс гауссов сдвиг с sigma, выбранной случайно из surface_sigmas
+struct SamplingParams {
+    std::string mode;
+    float uniform_fraction;
+    std::vector<float> surface_sigmas;
+
+    SamplingParams() : mode("uniform"), uniform_fraction(0.2f), surface_sigmas({0.003f, 0.01f, 0.05f}) {}
+};
+
+
+// Точка у поверхности остаётся в кубе [-1, 1]^3, где сеть запрашивается при рендере
+glm::vec3 sampleNearSurface(const Mesh& mesh, const SamplingParams& sampling, RandomStream& rng) {
+    glm::vec3 p = mesh.sampleSurface(rng);
+    float sigma = sampling.surface_sigmas[rng.below(sampling.surface_sigmas.size())];
+    for (int k = 0; k < 3; ++k) {
+        p[k] = std::min(1.0f, std::max(-1.0f, p[k] + sigma * rng.normal()));
+    }
+    return p;
+}
+
+
+bool useSurfaceSampling(const Mesh& mesh, const SamplingParams& sampling) {
+    if (sampling.mode != "uniform" && sampling.mode != "surface") {
+        std::cerr << "Неизвестный режим выборки: " << sampling.mode << ", используется uniform" << std::endl;
+    }
+    return sampling.mode == "surface" && !mesh.triangles.empty() && !sampling.surface_sigmas.empty();
+}
+
+
+// Точка номер index и расстояние до меша в её строку row. У каждой точки свой поток
+// (seed, Samples, index): нити ничего не делят, и точка не зависит от того, кто её считал
+void samplePoint(const Mesh& mesh, const SamplingParams& sampling, bool surface, uint64_t seed, uint64_t index,
+                 Matrix& points, Matrix& distances, size_t row) {
+    RandomStream rng(seed, randomStream(RandomPurpose::Samples, index));
+    if (surface && rng.uniform() >= sampling.uniform_fraction) {
+        glm::vec3 p = sampleNearSurface(mesh, sampling, rng);
+        points(row, 0) = p.x;
+        points(row, 1) = p.y;
+        points(row, 2) = p.z;
+    } else {
+        points(row, 0) = rng.uniform(-1.0f, 1.0f);
+        points(row, 1) = rng.uniform(-1.0f, 1.0f);
+        points(row, 2) = rng.uniform(-1.0f, 1.0f);
+    }
+
+    distances(row, 0) = mesh.distance(glm::vec3(points(row, 0), points(row, 1), points(row, 2)));
+}
+
+
+// Расстояние до меша стоит микросекунды, поэтому параллельно почти с любого числа точек;
+// куски динамические — у точек возле поверхности обход BVH дольше
+const ParallelPolicy SAMPLE_POLICY = {64, false};
+const size_t SAMPLE_CHUNK = 256;
+
+
+// Набор точек не зависит от числа нитей
+Data sampleData(Mesh& mesh, int num_samples = 50000, uint64_t seed = 0,
+                const SamplingParams& sampling = SamplingParams()) {
+    Matrix points(num_samples, 3);
+    Matrix distances(num_samples, 1);
+    bool surface = useSurfaceSampling(mesh, sampling);
+
+    parallelFor(num_samples, SAMPLE_POLICY, [&](size_t begin, size_t end, int) {
+        for (size_t i = begin; i < end; ++i) {
+            samplePoint(mesh, sampling, surface, seed, i, points, distances, i);
+        }
+    }, SAMPLE_CHUNK);
+    return {points, distances};
+}
+
+
+// Изменить, если меняется что-то в генерации точек, чтобы старые файлы кэша перестали подходить
+const uint32_t SAMPLE_CACHE_VERSION = 2;
+
+
+// Ключ кэша: содержимое .obj и всё, от чего зависят точки. Ядро треугольников в ключ не входит:
+// положения точек от него не зависят, а расстояния могут отличаться лишь в последних битах,
+// поэтому файлы кэша можно переносить между машинами
+uint64_t sampleCacheKey(const std::string& objPath, int num_samples, uint64_t seed, const SamplingParams& sampling) {
+    std::ifstream file(objPath, std::ios::binary);
+    if (!file) {
+        throw std::runtime_error("Не удалось открыть файл: " + objPath);
+    }
+    std::ostringstream contents;
+    contents << file.rdbuf();
+    std::string bytes = contents.str();
+
+    std::ostringstream settings;
+    settings << SAMPLE_CACHE_VERSION << " " << num_samples << " " << seed
+             << " " << sampling.mode;
+    if (sampling.mode == "surface") {
+        settings << " " << std::setprecision(9) << sampling.uniform_fraction;
+        for (float sigma : sampling.surface_sigmas) {
+            settings << " " << sigma;
+        }
+    }
+    std::string key = settings.str();
+
+    uint64_t hash = fnv1a(bytes.data(), bytes.size());
+    return fnv1a(key.data(), key.size(), hash);
+}
+
+
+// Точки для объекта из objPath через кэш в каталоге cacheDir (пустой — без кэша).
+// Файл в формате sdf*_points.bin, поэтому его же можно передать в train --points.
+// При попадании меш даже не загружается, расстояния не считаются
+Data cachedSampleData(const std::string& objPath, const std::string& cacheDir, int num_samples, uint64_t seed,
+                      const SamplingParams& sampling) {
+    if (cacheDir.empty()) {
+        Mesh mesh(objPath);
+        return sampleData(mesh, num_samples, seed, sampling);
+    }
+
+    std::ostringstream name;
+    name << "points_" << std::hex << std::setw(16) << std::setfill('0')
+         << sampleCacheKey(objPath, num_samples, seed, sampling) << ".bin";
+    std::filesystem::path path = std::filesystem::path(cacheDir) / name.str();
+
+    if (std::filesystem::exists(path)) {
+        try {
+            Data data = loadData(path.string());
+            if (static_cast<int>(data.x.rows) == num_samples) {
+                std::cout << "Точки загружены из кэша: " << path.string() << std::endl;
+                return data;
+            }
+        } catch (const std::runtime_error&) {
+        }
+        std::cerr << "Файл кэша повреждён и будет перезаписан: " << path.string() << std::endl;
+    }
+
+    Mesh mesh(objPath);
+    Data data = sampleData(mesh, num_samples, seed, sampling);
+
+    // Сначала во временный файл: прерванная запись не оставит в кэше обрезанных точек
+    std::filesystem::create_directories(cacheDir);
+    std::filesystem::path tmp = path;
+    tmp += ".tmp";
+    saveData(data, tmp.string());
+    std::filesystem::rename(tmp, path);
+    std::cout << "Точки сохранены в кэш: " << path.string() << std::endl;
+    return data;
+}
+
+
+// Фоновая генерация: workers нитей без остановки считают свежие батчи по batch_size точек
+// в кольцо из capacity ячеек, а обучение забирает их по одному через next().
+// Батч номер k состоит из точек k * batch_size ... (k + 1) * batch_size - 1, и next() отдаёт
+// батчи строго по порядку номеров, поэтому обучение не зависит от числа нитей и их расписания.
+// Нить берёт номер k, только когда ячейка k % capacity освобождена батчем k - capacity.
+// first_batch — номер первого батча, чтобы продолжить прерванное обучение с того же места.
+// Строки [row_begin, row_end) — генерировать только эту часть каждого батча (row_end < 0 — до конца),
+// как процесс распределённого обучения со своей частью батча
+class SampleGenerator {
+public:
+    SampleGenerator(const Mesh& mesh, const SamplingParams& sampling, uint64_t seed,
+                    int batch_size, int workers, int capacity, uint64_t first_batch = 0,
+                    int row_begin = 0, int row_end = -1)
+        : mesh(mesh), sampling(sampling), seed(seed), batch_size(batch_size), row_begin(row_begin),
+          rows((row_end < 0 ? batch_size : row_end) - row_begin),
+          surface(useSurfaceSampling(mesh, sampling)), slots(std::max(capacity, 1)),
+          next_produce(first_batch), next_consume(first_batch), ready_count(0), produced(0), stall(0.0), stop(false),
+          start(std::chrono::steady_clock::now()) {
+        for (Slot& slot : slots) {
+            slot.x = Matrix(rows, 3);
+            slot.y = Matrix(rows, 1);
+            slot.ready = false;
+        }
+        for (int i = 0; i < std::max(workers, 1); ++i) {
+            threads.emplace_back([this] { produce(); });
+        }
+    }
+
+    ~SampleGenerator() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        changed.notify_all();
+        for (std::thread& t : threads) {
+            t.join();
+        }
+    }
+
+    SampleGenerator(const SampleGenerator&) = delete;
+    SampleGenerator& operator=(const SampleGenerator&) = delete;
+
+    // Следующий по порядку батч; если он ещё не готов, ждёт и учитывает ожидание в stallSeconds()
+    Data next() {
+        Data batch = {Matrix(rows, 3), Matrix(rows, 1)};
+        next(batch);
+        return batch;
+    }
+
+    // То же в готовый батч того же размера, без выделения памяти
+    void next(Data& batch) {
+        std::unique_lock<std::mutex> lock(mutex);
+        Slot& slot = slots[next_consume % slots.size()];
+        if (!slot.ready) {
+            auto begin = std::chrono::steady_clock::now();
+            changed.wait(lock, [&] { return slot.ready; });
+            stall += std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        }
+        std::copy(slot.x.data.begin(), slot.x.data.end(), batch.x.data.begin());
+        std::copy(slot.y.data.begin(), slot.y.data.end(), batch.y.data.begin());
+        slot.ready = false;
+        --ready_count;
+        ++next_consume;
+        lock.unlock();
+        changed.notify_all();
+    }
+
+    // Готовых батчей в кольце: почти всегда capacity — генерация успевает, почти всегда 0 — не успевает
+    int depth() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return ready_count;
+    }
+
+    int capacity() const {
+        return slots.size();
+    }
+
+    // Точек в секунду с момента запуска
+    double throughput() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return elapsed > 0.0 ? produced / elapsed : 0.0;
+    }
+
+    // Сколько секунд обучение простояло в next() в ожидании батча
+    double stallSeconds() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stall;
+    }
+
+private:
+    struct Slot {
+        Matrix x, y;
+        bool ready;
+    };
+
+    const Mesh& mesh;
+    SamplingParams sampling;
+    uint64_t seed;
+    int batch_size, row_begin, rows;
+    bool surface;
+
+    std::vector<Slot> slots;
+    std::vector<std::thread> threads;
+    mutable std::mutex mutex;
+    std::condition_variable changed;
+    uint64_t next_produce, next_consume;
+    int ready_count;
+    uint64_t produced;
+    double stall;
+    bool stop;
+    std::chrono::steady_clock::time_point start;
+
+    void produce() {
+        while (true) {
+            uint64_t k;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&] { return stop || next_produce < next_consume + slots.size(); });
+                if (stop) {
+                    return;
+                }
+                k = next_produce++;
+            }
+
+            // Ячейка принадлежит только этой нити, пока не помечена готовой
+            Slot& slot = slots[k % slots.size()];
+            for (int j = 0; j < rows; ++j) {
+                samplePoint(mesh, sampling, surface, seed, k * batch_size + row_begin + j, slot.x, slot.y, j);
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                slot.ready = true;
+                ++ready_count;
+                produced += rows;
+            }
+            changed.notify_all();
+        }
+    }
+};
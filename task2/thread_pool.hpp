@@ -0,0 +1,380 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <iostream>
+#include <algorithm>
+#include <omp.h>
+#include <pthread.h>
+#include <sched.h>
+
+
+// Постоянный пул нитей для мелких параллельных циклов: регион OpenMP стоит микросекунды, а шаг обучения
+// небольшой сети открывает их десятки. Нити пула живут всё время работы программы и закреплены за ядрами.
+// Цикл режется на куски по chunk элементов; каждая нить получает свой отрезок номеров кусков в ячейке
+// range (начало и конец в одном 64-битном слове), берёт куски с начала, а закончив свои — забирает
+// половину чужого отрезка с конца. Обе операции — один CAS, без блокировок и без выделения памяти.
+// Ожидающая нить сначала крутится (новый цикл обычно приходит через доли микросекунды), потом засыпает.
+// Вызывающая нить работает как участник 0. Пул выполняет один цикл за раз: если он занят другой нитью
+// или run вызван изнутри куска, run возвращает false, и цикл нужно выполнить самому.
+// Номер цикла и число его участников публикуются одним атомарным словом job: нить, проснувшаяся
+// на старом цикле, не примет чужое число участников, и поля цикла читаются только после acquire
+// того слова, которое их опубликовало. Каждая выбранная нить отмечается ровно один раз за цикл
+class ThreadPool {
+public:
+    // Кусок [begin, end) на участнике worker; не должен бросать исключений
+    using Body = void (*)(void* ctx, size_t begin, size_t end, int worker);
+
+    // first_cpu — с какого из доступных ядер начинать закрепление, total_cpus — сколько ядер нужно всем
+    // процессам, которые делят машину (0 — только этому пулу)
+    explicit ThreadPool(int threads, bool pin = true, int first_cpu = 0, int total_cpus = 0)
+        : num_threads(std::min(std::max(threads, 1), int(PARTICIPANTS_MASK))), queues(num_threads),
+          owner(std::this_thread::get_id()) {
+        std::vector<int> cpus = allowedCpus();
+        // Закрепляем, только если ядер хватает на всех: иначе нити мешали бы друг другу на одном ядре
+        bool pinned = pin && static_cast<int>(cpus.size()) >= std::max(total_cpus, first_cpu + num_threads);
+        for (int i = 1; i < num_threads; ++i) {
+            workers.emplace_back([this, i] { work(i); });
+            if (pinned) {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(cpus[first_cpu + i], &set);
+                pthread_setaffinity_np(workers.back().native_handle(), sizeof(set), &set);
+            }
+        }
+    }
+
+    ~ThreadPool() {
+        stop.store(true);
+        job.fetch_add(uint64_t(1) << PARTICIPANTS_BITS);
+        {
+            std::lock_guard<std::mutex> lock(park_mutex);
+        }
+        wake.notify_all();
+        for (std::thread& t : workers) {
+            t.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const {
+        return num_threads;
+    }
+
+    // Нить, создавшая пул. Только её циклы идут в пул, циклы других нитей (фоновой работы) — в OpenMP,
+    // чтобы долгий фоновый рендер не занимал пул и не оставлял обучение на одной нити
+    bool ownedByCurrentThread() const {
+        return std::this_thread::get_id() == owner;
+    }
+
+    // Выполняет body по кускам [0, n) на participants нитях (включая вызывающую) и дожидается конца.
+    // chunk = 0 — куски такие, чтобы на нить пришлось по несколько
+    bool run(size_t n, size_t chunk, int participants, Body body, void* ctx) {
+        if (inside_task) {
+            return false;
+        }
+        std::unique_lock<std::mutex> lock(dispatch, std::try_to_lock);
+        if (!lock.owns_lock()) {
+            return false;
+        }
+
+        participants = std::min(std::max(participants, 1), num_threads);
+        if (chunk == 0) {
+            chunk = (n + participants * 4 - 1) / (participants * 4);
+        }
+        chunk = std::max(chunk, (n + UINT32_MAX - 1) / UINT32_MAX);
+        chunk = std::max<size_t>(chunk, 1);
+        size_t chunks = (n + chunk - 1) / chunk;
+
+        job_body = body;
+        job_ctx = ctx;
+        job_size = n;
+        job_chunk = chunk;
+        for (int t = 0; t < participants; ++t) {
+            queues[t].range.store(pack(chunks * t / participants, chunks * (t + 1) / participants),
+                                  std::memory_order_relaxed);
+        }
+        remaining.store(chunks, std::memory_order_relaxed);
+        active.store(participants - 1, std::memory_order_relaxed);
+        // Слово job меняет только вызывающая нить под dispatch
+        uint64_t generation = (job.load(std::memory_order_relaxed) >> PARTICIPANTS_BITS) + 1;
+        job.store(generation << PARTICIPANTS_BITS | uint64_t(participants), std::memory_order_seq_cst);
+        if (participants > 1 && sleepers.load(std::memory_order_seq_cst) > 0) {
+            {
+                std::lock_guard<std::mutex> park(park_mutex);
+            }
+            wake.notify_all();
+        }
+
+        inside_task = true;
+        execute(0, participants);
+        inside_task = false;
+
+        // Нити, выбранные для цикла, должны отметиться: иначе опоздавшая взяла бы кусок следующего цикла
+        for (int spin = 0; remaining.load(std::memory_order_acquire) > 0 || active.load(std::memory_order_acquire) > 0;
+             ++spin) {
+            relax(spin);
+        }
+        return true;
+    }
+
+    // Выполняется ли текущая нить внутри куска цикла пула
+    static bool insideTask() {
+        return inside_task;
+    }
+
+private:
+    // Сколько ждущая нить крутится, прежде чем заснуть
+    static constexpr double SPIN_MICROSECONDS = 50.0;
+    // Младшие биты слова job — число участников цикла, старшие — номер цикла
+    static constexpr int PARTICIPANTS_BITS = 16;
+    static constexpr uint64_t PARTICIPANTS_MASK = (uint64_t(1) << PARTICIPANTS_BITS) - 1;
+
+    struct alignas(64) Queue {
+        std::atomic<uint64_t> range{0};
+    };
+
+    int num_threads;
+    std::vector<Queue> queues;
+    std::vector<std::thread> workers;
+    std::mutex dispatch;
+    std::thread::id owner;
+
+    Body job_body = nullptr;
+    void* job_ctx = nullptr;
+    size_t job_size = 0, job_chunk = 1;
+    alignas(64) std::atomic<uint64_t> job{0};
+    alignas(64) std::atomic<size_t> remaining{0};
+    alignas(64) std::atomic<int> active{0};
+    std::atomic<int> sleepers{0};
+    std::atomic<bool> stop{false};
+    std::mutex park_mutex;
+    std::condition_variable wake;
+
+    static inline thread_local bool inside_task = false;
+
+    static uint64_t pack(uint64_t begin, uint64_t end) {
+        return begin << 32 | end;
+    }
+
+    static void relax(int spin) {
+        if (spin < 64) {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+        } else {
+            std::this_thread::yield();
+        }
+    }
+
+    static std::vector<int> allowedCpus() {
+        std::vector<int> cpus;
+        cpu_set_t set;
+        if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+                if (CPU_ISSET(cpu, &set)) {
+                    cpus.push_back(cpu);
+                }
+            }
+        }
+        return cpus;
+    }
+
+    // Кусок с начала своего отрезка
+    bool pop(int t, uint64_t& chunk) {
+        uint64_t range = queues[t].range.load(std::memory_order_acquire);
+        while ((range >> 32) < (range & 0xffffffffu)) {
+            if (queues[t].range.compare_exchange_weak(range, range + (uint64_t(1) << 32), std::memory_order_acq_rel)) {
+                chunk = range >> 32;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Половина чужого отрезка с конца: первый кусок выполняется сразу, остальные становятся своим отрезком.
+    // Свой отрезок в этот момент пуст, и другие нити его не меняют, поэтому его можно просто записать
+    bool steal(int t, int participants, uint64_t& chunk) {
+        for (int k = 1; k < participants; ++k) {
+            Queue& victim = queues[(t + k) % participants];
+            uint64_t range = victim.range.load(std::memory_order_acquire);
+            while (true) {
+                uint64_t begin = range >> 32, end = range & 0xffffffffu;
+                if (begin >= end) {
+                    break;
+                }
+                uint64_t split = end - (end - begin + 1) / 2;
+                if (victim.range.compare_exchange_weak(range, pack(begin, split), std::memory_order_acq_rel)) {
+                    chunk = split;
+                    if (split + 1 < end) {
+                        queues[t].range.store(pack(split + 1, end), std::memory_order_release);
+                    }
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    void execute(int t, int participants) {
+        uint64_t chunk;
+        while (pop(t, chunk) || steal(t, participants, chunk)) {
+            size_t begin = chunk * job_chunk;
+            job_body(job_ctx, begin, std::min(job_size, begin + job_chunk), t);
+            remaining.fetch_sub(1, std::memory_order_acq_rel);
+        }
+    }
+
+    // Новое слово job (acquire: поля цикла, опубликованные им, видны)
+    uint64_t waitJob(uint64_t seen) {
+        auto start = std::chrono::steady_clock::now();
+        for (int spin = 0;; ++spin) {
+            uint64_t current = job.load(std::memory_order_acquire);
+            if (current != seen) {
+                return current;
+            }
+            if (spin % 64 == 63 && std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start)
+                                           .count() > SPIN_MICROSECONDS) {
+                break;
+            }
+            relax(spin);
+        }
+
+        std::unique_lock<std::mutex> lock(park_mutex);
+        sleepers.fetch_add(1, std::memory_order_seq_cst);
+        wake.wait(lock, [&] { return job.load(std::memory_order_seq_cst) != seen; });
+        sleepers.fetch_sub(1, std::memory_order_relaxed);
+        return job.load(std::memory_order_acquire);
+    }
+
+    void work(int index) {
+        inside_task = true;
+        uint64_t seen = 0;
+        while (true) {
+            // Число участников берётся из того же слова, что и номер цикла: пропущенные циклы не видны вовсе
+            seen = waitJob(seen);
+            if (stop.load()) {
+                return;
+            }
+            int participants = static_cast<int>(seen & PARTICIPANTS_MASK);
+            if (index < participants) {
+                execute(index, participants);
+                active.fetch_sub(1, std::memory_order_release);
+            }
+        }
+    }
+};
+
+
+// Чем выполняются параллельные циклы: OpenMP или ThreadPool. Задаётся переменной окружения
+// SIREN_PARALLEL_BACKEND=openmp|pool; в обоих случаях нитей не больше omp_get_max_threads() вызывающей нити.
+// Пул обслуживает только нить, которая его создала, остальные нити всегда используют OpenMP
+enum class ParallelBackend { OpenMP, Pool };
+
+inline ParallelBackend& parallelBackend() {
+    static ParallelBackend backend = [] {
+        const char* name = std::getenv("SIREN_PARALLEL_BACKEND");
+        if (name && std::string(name) == "pool") {
+            return ParallelBackend::Pool;
+        }
+        if (name && std::string(name) != "openmp") {
+            std::cerr << "Неизвестный SIREN_PARALLEL_BACKEND: " << name << ", используется openmp" << std::endl;
+        }
+        return ParallelBackend::OpenMP;
+    }();
+    return backend;
+}
+
+
+// Какие ядра закреплять за пулом, если машину делят несколько процессов (распределённое обучение):
+// пул процесса берёт ядра с first, всем процессам вместе нужно total ядер. Задаётся до создания пула
+struct PoolCpuRange {
+    int first = 0, total = 0;
+};
+
+inline PoolCpuRange& poolCpuRange() {
+    static PoolCpuRange range;
+    return range;
+}
+
+
+// Пул создаётся при первом обращении на omp_get_max_threads() нитей, поэтому первой к нему должна обратиться
+// основная нить после omp_set_num_threads: ей пул и принадлежит. SIREN_POOL_PIN=0 отключает закрепление за ядрами
+inline ThreadPool& threadPool() {
+    static ThreadPool pool(omp_get_max_threads(),
+                           !std::getenv("SIREN_POOL_PIN") || std::string(std::getenv("SIREN_POOL_PIN")) != "0",
+                           poolCpuRange().first, poolCpuRange().total);
+    return pool;
+}
+
+
+// Идут ли циклы текущей нити в пул
+inline bool usePool() {
+    return parallelBackend() == ParallelBackend::Pool && threadPool().ownedByCurrentThread();
+}
+
+
+// Сколько нитей может занять параллельный цикл, запущенный из текущей нити
+inline int parallelWorkers() {
+    if (usePool()) {
+        return std::min(threadPool().size(), omp_get_max_threads());
+    }
+    return omp_get_max_threads();
+}
+
+
+// Внутри параллельного цикла (OpenMP или пула) вложенный цикл выгоднее выполнить одной нитью
+inline bool inParallelRegion() {
+    return omp_in_parallel() || ThreadPool::insideTask();
+}
+
+
+// body(begin, end, worker) обрабатывает элементы [begin, end) на участнике worker < parallelWorkers()
+// (номер нужен для рабочей памяти по нити). Не больше threads нитей, threads <= 1 — в вызывающей нити.
+// chunk = 0 — поровну между нитями, иначе куски по chunk элементов раздаются динамически
+template <class F>
+void parallelFor(size_t n, int threads, F body, size_t chunk = 0) {
+    if (n == 0) {
+        return;
+    }
+    threads = std::min(threads, parallelWorkers());
+    if (threads <= 1) {
+        body(size_t(0), n, 0);
+        return;
+    }
+
+    if (usePool()) {
+        ThreadPool::Body call = [](void* ctx, size_t begin, size_t end, int worker) {
+            (*static_cast<F*>(ctx))(begin, end, worker);
+        };
+        if (!threadPool().run(n, chunk, threads, call, &body)) {
+            body(size_t(0), n, 0);
+        }
+        return;
+    }
+
+    if (chunk == 0) {
+        #pragma omp parallel num_threads(threads)
+        {
+            size_t t = omp_get_thread_num(), count = omp_get_num_threads();
+            if (n * t / count < n * (t + 1) / count) {
+                body(n * t / count, n * (t + 1) / count, static_cast<int>(t));
+            }
+        }
+    } else {
+        size_t chunks = (n + chunk - 1) / chunk;
+        #pragma omp parallel for schedule(dynamic) num_threads(threads)
+        for (size_t c = 0; c < chunks; ++c) {
+            body(c * chunk, std::min(n, (c + 1) * chunk), omp_get_thread_num());
+        }
+    }
+}
@@ -35,21 +35,18 @@ glm::vec3 cross(glm::vec3 &vec1, glm::vec3 &vec2)
 }
 
 
-float sdf(SIREN& model, const glm::vec3 &point) {
-    float distance;
-    Matrix x(point);
-    Matrix y = model.forward(x);
-    distance = y(0, 0);
-    return distance;
+float sdf(const SIREN& model, const glm::vec3 &point, InferenceWorkspace& ws) {
+    float x[3] = {point.x, point.y, point.z};
+    return model.forward(x, 1, ws)[0];
 }
 
 
-glm::vec3 getNormal(const glm::vec3& p, SIREN& model, float epsilon = 1e-4) {
-    float sdfX = sdf(model, glm::vec3(p.x + epsilon, p.y, p.z)) - sdf(model, glm::vec3(p.x - epsilon, p.y, p.z));
-    float sdfY = sdf(model, glm::vec3(p.x, p.y + epsilon, p.z)) - sdf(model, glm::vec3(p.x, p.y - epsilon, p.z));
-    float sdfZ = sdf(model, glm::vec3(p.x, p.y, p.z + epsilon)) - sdf(model, glm::vec3(p.x, p.y, p.z - epsilon));
+// Точная нормаль — нормированный градиент SDF по точке (один прямой и один обратный проход сети)
+glm::vec3 getNormal(const glm::vec3& p, const SIREN& model, InferenceWorkspace& ws) {
+    float x[3] = {p.x, p.y, p.z};
+    const float* grad = model.inputGradient(x, 1, ws);
 
-    glm::vec3 normal(sdfX, sdfY, sdfZ);
+    glm::vec3 normal(grad[0], grad[1], grad[2]);
     return glm::normalize(normal);
 }
 
@@ -65,7 +62,8 @@ glm::vec3 getNormalMesh(const glm::vec3& p, Mesh& mesh, float epsilon = 1e-4) {
 
 
 glm::vec3 trace(
-    SIREN& model,
+    const SIREN& model,
+    InferenceWorkspace& ws,
     glm::vec3 &lightDir,
     glm::vec3 &cameraPos,
     glm::vec3 &rayDir
@@ -78,12 +76,12 @@ glm::vec3 trace(
             glm::vec3 outsideDist = glm::max(glm::abs(point) - glm::vec3(1.0, 1.0, 1.0), 0.01f);
             distance = glm::length(outsideDist);
         } else {
-            distance = sdf(model, point);
+            distance = sdf(model, point, ws);
             // distance = mesh.distance(point);
         }
 
         if (distance < 0.001f) {
-            glm::vec3 normal = getNormal(point, model);
+            glm::vec3 normal = getNormal(point, model, ws);
             // glm::vec3 normal = getNormalMesh(point, mesh);
             float diffuse = std::max(glm::dot(normal, lightDir), 0.08f);
 
@@ -97,6 +95,105 @@ glm::vec3 trace(
 }
 
 
+enum class RenderMode { PerPixel, Wavefront };
+
+// Сторона тайла волнового рендера: лучи тайла идут в сеть одним батчем
+const int WAVEFRONT_TILE = 32;
+
+// Строка пикселей или тайл — работа на сотни микросекунд, параллельно всегда, кроме вложенного вызова
+const ParallelPolicy RENDER_POLICY = {2, false};
+
+
+// Очередь лучей одного тайла. Живёт у нити и переиспользуется между тайлами
+struct WavefrontState {
+    std::vector<glm::vec3> dirs;
+    std::vector<int> pixels;
+    std::vector<float> t, distances;
+    std::vector<int> active, hits;
+    std::vector<int> batch_rays;
+    std::vector<float> batch_points;
+};
+
+
+// Тот же алгоритм, что и trace(), но все активные лучи тайла делают шаг одновременно:
+// на каждой итерации сеть считается одним батчем по лучам внутри куба [-1, 1]^3,
+// лучи, которые попали в поверхность или ушли дальше 100, выбрасываются из очереди.
+// Нормали всех попаданий считаются ещё одним батчем градиентов SDF.
+void traceWavefront(
+    const SIREN& model,
+    InferenceWorkspace& ws,
+    WavefrontState& st,
+    const glm::vec3& lightDir,
+    const glm::vec3& cameraPos,
+    float* output
+) {
+    size_t n = st.dirs.size();
+    st.t.assign(n, 0.0f);
+    st.distances.resize(n);
+    st.active.resize(n);
+    st.hits.clear();
+    for (size_t r = 0; r < n; ++r) {
+        st.active[r] = r;
+        float* pixel = output + 3 * st.pixels[r];
+        pixel[0] = pixel[1] = pixel[2] = 0.0f;
+    }
+
+    for (int iter = 0; iter < 100 && !st.active.empty(); ++iter) {
+        st.batch_rays.clear();
+        st.batch_points.clear();
+        for (int r : st.active) {
+            glm::vec3 point = cameraPos + st.t[r] * st.dirs[r];
+            if (point.x < -1 || point.x > 1 || point.y < -1 || point.y > 1 || point.z < -1 || point.z > 1) {
+                glm::vec3 outsideDist = glm::max(glm::abs(point) - glm::vec3(1.0, 1.0, 1.0), 0.01f);
+                st.distances[r] = glm::length(outsideDist);
+            } else {
+                st.batch_rays.push_back(r);
+                st.batch_points.insert(st.batch_points.end(), {point.x, point.y, point.z});
+            }
+        }
+
+        if (!st.batch_rays.empty()) {
+            const float* d = model.forward(st.batch_points.data(), st.batch_rays.size(), ws);
+            for (size_t k = 0; k < st.batch_rays.size(); ++k) {
+                st.distances[st.batch_rays[k]] = d[k];
+            }
+        }
+
+        size_t kept = 0;
+        for (int r : st.active) {
+            if (st.distances[r] < 0.001f) {
+                st.hits.push_back(r);
+                continue;
+            }
+            st.t[r] += st.distances[r];
+            if (st.t[r] < 100.0f) {
+                st.active[kept++] = r;
+            }
+        }
+        st.active.resize(kept);
+    }
+
+    if (st.hits.empty()) {
+        return;
+    }
+
+    st.batch_points.clear();
+    for (int r : st.hits) {
+        glm::vec3 p = cameraPos + st.t[r] * st.dirs[r];
+        st.batch_points.insert(st.batch_points.end(), {p.x, p.y, p.z});
+    }
+    const float* grad = model.inputGradient(st.batch_points.data(), st.hits.size(), ws);
+    for (size_t k = 0; k < st.hits.size(); ++k) {
+        const float* gk = grad + 3 * k;
+        glm::vec3 normal = glm::normalize(glm::vec3(gk[0], gk[1], gk[2]));
+        float diffuse = std::max(glm::dot(normal, lightDir), 0.08f);
+
+        float* pixel = output + 3 * st.pixels[st.hits[k]];
+        pixel[0] = pixel[1] = pixel[2] = diffuse;
+    }
+}
+
+
 Scene loadScene(const std::string& cameraFile, const std::string& lightFile) {
     Scene scene;
     scene.camera.from_file(cameraFile.c_str());
@@ -106,11 +203,12 @@ Scene loadScene(const std::string& cameraFile, const std::string& lightFile) {
 
 
 void render(
-    SIREN& model,
+    const SIREN& model,
     const std::string& cameraFile, 
     const std::string& lightFile, 
     const std::string& saveFile, 
-    int image_size
+    int image_size,
+    RenderMode mode = RenderMode::Wavefront
 ) {
     Scene scene = loadScene(cameraFile, lightFile);
     int width = image_size, height = image_size;
@@ -131,22 +229,53 @@ void render(
 
     auto start = std::chrono::high_resolution_clock::now();
 
-    #pragma omp parallel for
-    for(int j = 0; j < height; ++j) {
-        for(int i = 0; i < width; ++i) {
-            float x = (2.0f * (i + 0.5f) / width - 1.0f) * aspectRatio * scale;
-            float y = (2.0f * (j + 0.5f) / height - 1.0f) * scale;
-
-            glm::vec3 rayDir = glm::normalize(view + right * x + up * y);
-
-            int index = 3 * (i + j * width);
-
-            glm::vec3 color = trace(model, lightDir, cameraPos, rayDir);
-
-            output[index] = color.x;
-            output[index + 1] = color.y;
-            output[index + 2] = color.z;
-        }
+    // Своя рабочая память у каждого участника цикла: модель только читается
+    std::vector<InferenceWorkspace> workspaces(parallelWorkers());
+
+    if (mode == RenderMode::PerPixel) {
+        parallelFor(height, RENDER_POLICY, [&](size_t begin, size_t end, int worker) {
+            InferenceWorkspace& ws = workspaces[worker];
+            for (int j = begin; j < static_cast<int>(end); ++j) {
+                for(int i = 0; i < width; ++i) {
+                    float x = (2.0f * (i + 0.5f) / width - 1.0f) * aspectRatio * scale;
+                    float y = (2.0f * (j + 0.5f) / height - 1.0f) * scale;
+
+                    glm::vec3 rayDir = glm::normalize(view + right * x + up * y);
+
+                    int index = 3 * (i + j * width);
+
+                    glm::vec3 color = trace(model, ws, lightDir, cameraPos, rayDir);
+
+                    output[index] = color.x;
+                    output[index + 1] = color.y;
+                    output[index + 2] = color.z;
+                }
+            }
+        }, 1);
+    } else {
+        int tilesX = (width + WAVEFRONT_TILE - 1) / WAVEFRONT_TILE;
+        int tilesY = (height + WAVEFRONT_TILE - 1) / WAVEFRONT_TILE;
+        std::vector<WavefrontState> states(workspaces.size());
+
+        parallelFor(tilesX * tilesY, RENDER_POLICY, [&](size_t begin, size_t end, int worker) {
+            InferenceWorkspace& ws = workspaces[worker];
+            WavefrontState& st = states[worker];
+            for (int tile = begin; tile < static_cast<int>(end); ++tile) {
+                int i0 = (tile % tilesX) * WAVEFRONT_TILE, j0 = (tile / tilesX) * WAVEFRONT_TILE;
+                st.dirs.clear();
+                st.pixels.clear();
+                for (int j = j0; j < std::min(j0 + WAVEFRONT_TILE, height); ++j) {
+                    for (int i = i0; i < std::min(i0 + WAVEFRONT_TILE, width); ++i) {
+                        float x = (2.0f * (i + 0.5f) / width - 1.0f) * aspectRatio * scale;
+                        float y = (2.0f * (j + 0.5f) / height - 1.0f) * scale;
+
+                        st.dirs.push_back(glm::normalize(view + right * x + up * y));
+                        st.pixels.push_back(i + j * width);
+                    }
+                }
+                traceWavefront(model, ws, st, lightDir, cameraPos, output);
+            }
+        }, 1);
     }
 
     auto end = std::chrono::high_resolution_clock::now();
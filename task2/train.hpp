@@ -1,10 +1,31 @@
 #include "trace.hpp"
+#include "sampler.hpp"
+#include "background.hpp"
+#include "data_parallel.hpp"
+#include "distributed.hpp"
+#include <atomic>
 
 struct TrainParams {
     int batch_size, num_steps, log_iter, checkpoint_iter, render_iter;
     float lr;
-
-    TrainParams(const std::string& filePath) : log_iter(100), checkpoint_iter(100), lr(0.00005f), render_iter(1000) {
+    std::string optimizer;
+    float momentum;
+    int grad_accum_steps;
+    float grad_clip;
+    uint64_t seed;
+    int num_samples;
+    SamplingParams sampling;
+    int sample_workers, sample_queue;
+    std::string sample_cache;
+    int background_threads;
+    int data_parallel;
+
+    TrainParams(const std::string& filePath) : log_iter(100), checkpoint_iter(100), lr(0.00005f), render_iter(1000),
+                                               optimizer("adam"), momentum(0.9f),
+                                               grad_accum_steps(1), grad_clip(0.0f), seed(0),
+                                               num_samples(50000), sample_workers(0), sample_queue(16),
+                                               sample_cache("train_results/samples"), background_threads(1),
+                                               data_parallel(1) {
         std::ifstream file(filePath);
         if (!file.is_open()) {
             std::cerr << "Не удалось открыть файл: " << filePath << std::endl;
@@ -29,70 +50,91 @@ struct TrainParams {
                 iss >> render_iter;
             } else if (key == "learning_rate") {
                 iss >> lr;
+            } else if (key == "optimizer") {
+                iss >> optimizer;
+            } else if (key == "momentum") {
+                iss >> momentum;
+            } else if (key == "grad_accum_steps") {
+                iss >> grad_accum_steps;
+            } else if (key == "grad_clip") {
+                iss >> grad_clip;
+            } else if (key == "seed") {
+                iss >> seed;
+            } else if (key == "num_samples") {
+                iss >> num_samples;
+            } else if (key == "sampling") {
+                iss >> sampling.mode;
+            } else if (key == "uniform_fraction") {
+                iss >> sampling.uniform_fraction;
+            } else if (key == "surface_sigmas") {
+                sampling.surface_sigmas.clear();
+                float sigma;
+                while (iss >> sigma) {
+                    sampling.surface_sigmas.push_back(sigma);
+                }
+            } else if (key == "sample_workers") {
+                iss >> sample_workers;
+            } else if (key == "sample_queue") {
+                iss >> sample_queue;
+            } else if (key == "background_threads") {
+                iss >> background_threads;
+            } else if (key == "data_parallel") {
+                iss >> data_parallel;
+            } else if (key == "sample_cache") {
+                iss >> sample_cache;
+                if (sample_cache == "none") {
+                    sample_cache.clear();
+                }
             } else {
                 std::cerr << "Неизвестный параметр: " << key << std::endl;
             }
         }
-    }
-};
-
-
-Data sampleData(Mesh& mesh, int num_samples = 50000) {
-    Matrix points(num_samples, 3);
-    Matrix distances(num_samples, 1);
-
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_real_distribution<> dis(-1.0, 1.0);
 
-    int count = 0;
-
-    #pragma omp parallel for
-    for (int i = 0; i < num_samples; ++i) {
-        points(i, 0) = dis(gen);
-        points(i, 1) = dis(gen);
-        points(i, 2) = dis(gen);
-
-        distances(i, 0) = mesh.distance(glm::vec3(points(i, 0), points(i, 1), points(i, 2)));
+        if (grad_accum_steps < 1) {
+            throw std::runtime_error("grad_accum_steps должен быть не меньше 1");
+        }
+        if (optimizer != "adam" && optimizer != "sgd") {
+            throw std::runtime_error("Неизвестный optimizer: " + optimizer + " (нужен adam или sgd)");
+        }
     }
-    return {points, distances};
-}
-
+};
 
-Data getBatch(const Data& data, int batchSize) {
-    std::random_device rd;
-    std::mt19937 gen(rd());
 
+// Заполняет готовый батч batch (его число строк — размер батча), память не выделяется.
+// skip — сколько первых строк батча пропустить: batch получает строки skip, skip + 1, ...
+void getBatch(const Data& data, RandomStream& rng, Data& batch, size_t skip = 0) {
     int N = data.x.rows, input_size = data.x.cols, output_size = data.y.cols;
-    std::uniform_int_distribution<> dis(0, N - 1);
 
-    Matrix batchX(batchSize, input_size);
-    Matrix batchY(batchSize, output_size);
+    for (size_t i = 0; i < skip; ++i) {
+        rng.below(N);
+    }
 
-    for (int i = 0; i < batchSize; ++i) {
-        int idx = dis(gen);
+    for (size_t i = 0; i < batch.x.rows; ++i) {
+        int idx = rng.below(N);
         for (int j = 0; j < input_size; ++j) {
-            batchX(i, j) = data.x(idx, j);
+            batch.x(i, j) = data.x(idx, j);
         }
         for (int j = 0; j < output_size; ++j) {
-            batchY(i, j) = data.y(idx, j);
+            batch.y(i, j) = data.y(idx, j);
         }
     }
+}
 
-    return {batchX, batchY};
+Data getBatch(const Data& data, int batchSize, RandomStream& rng) {
+    Data batch = {Matrix(batchSize, data.x.cols), Matrix(batchSize, data.y.cols)};
+    getBatch(data, rng, batch);
+    return batch;
 }
 
-void printRandomSamples(const Data& data, int num_samples=10) {
-    std::random_device rd;
-    std::mt19937 gen(rd());
+void printRandomSamples(const Data& data, int num_samples=10, uint64_t seed = 0) {
+    RandomStream rng(seed, randomStream(RandomPurpose::Debug, 0));
 
     int N = data.x.rows, input_size = data.x.cols, output_size = data.y.cols;
-    std::uniform_int_distribution<> dis(0, N - 1);
 
     int count = 0;
 
     for (int i = 0; i < num_samples; ++i) {
-        int idx = dis(gen);
+        int idx = rng.below(N);
         std::cout << "Point " << i << ":" << std::endl;
         for (int j = 0; j < input_size; ++j) {
             std::cout << data.x(idx, j) << " ";
@@ -116,59 +158,260 @@ void printRandomSamples(const Data& data, int num_samples=10) {
 }
 
 
-void train(
-    SIREN& model, 
-    Data& data,
+std::unique_ptr<Optimizer> makeOptimizer(const TrainParams& params) {
+    if (params.optimizer == "sgd") {
+        return std::unique_ptr<Optimizer>(new SGD(params.lr, params.momentum));
+    }
+    return std::unique_ptr<Optimizer>(new Adam(params.lr));
+}
+
+
+// Состояние цикла обучения, которое чекпоинт хранит рядом с весами и состоянием оптимизатора:
+// номер следующего шага и seed. Батчи и точки берутся из счётчикового генератора по (seed, номер
+// микробатча или точки), поэтому другого состояния у ГСЧ нет, и продолжение совпадает бит в бит
+struct TrainState {
+    uint64_t step;
+    uint64_t seed;
+};
+
+// Тензоры файла весов — float, состояние лежит в них побитно
+const size_t TRAIN_STATE_FLOATS = sizeof(TrainState) / sizeof(float);
+
+
+WeightsSnapshot checkpointSnapshot(SIREN& model, const TrainState& state) {
+    float bits[TRAIN_STATE_FLOATS];
+    std::memcpy(bits, &state, sizeof(state));
+    return model.snapshotWeights(true, {{"train.state", bits, TRAIN_STATE_FLOATS}});
+}
+
+
+void saveCheckpoint(SIREN& model, const TrainState& state, const std::string& filename) {
+    checkpointSnapshot(model, state).write(filename);
+}
+
+
+// Загружает в модель веса и состояние оптимизатора из чекпоинта и возвращает шаг, с которого
+// продолжать. Оптимизатор создаётся заново по params до загрузки, чтобы принять сохранённое состояние;
+// если в чекпоинте его нет (другой optimizer), продолжение не начинается.
+// seed берётся из чекпоинта: с другим seed продолжение не совпало бы с непрерывным обучением
+int resumeTraining(SIREN& model, TrainParams& params, const std::string& filename) {
+    model.setOptimizer(makeOptimizer(params));
+    model.loadWeights(filename, true);
+
+    WeightsFile file(filename);
+    size_t count;
+    const float* bits = file.tensor("train.state", count);
+    if (!bits || count != TRAIN_STATE_FLOATS) {
+        throw std::runtime_error("В файле " + filename + " нет состояния обучения: это не чекпоинт train");
+    }
+    TrainState state;
+    std::memcpy(&state, bits, sizeof(state));
+    if (state.seed != params.seed) {
+        std::cerr << "seed в параметрах (" << params.seed << ") отличается от seed чекпоинта ("
+                  << state.seed << "), используется seed чекпоинта" << std::endl;
+        params.seed = state.seed;
+    }
+    std::cout << "Обучение продолжается с шага " << state.step << " из " << filename << std::endl;
+    return static_cast<int>(state.step);
+}
+
+
+// Счётчик выделений памяти в куче, если программа его подключила (alloc_counter.hpp в main.cpp).
+// Тогда в лог выводится среднее число выделений за шаг с прошлой записи лога. Счётчик общий для процесса:
+// выделения фоновых нитей (чекпоинты, рендеры, генерация точек) во время шага попадают в этот шаг
+inline const std::atomic<uint64_t>* heap_allocation_counter = nullptr;
+
+
+// Строки [begin, end) каждого микробатча, которые считает процесс распределённого обучения comm
+// (без comm — весь микробатч). Части процессов идут подряд по порядку rank
+size_t rankRowsBegin(const TrainParams& params, const AllReduce* comm) {
+    return comm ? size_t(params.batch_size) * comm->rank() / comm->size() : 0;
+}
+
+size_t rankRowsEnd(const TrainParams& params, const AllReduce* comm) {
+    return comm ? size_t(params.batch_size) * (comm->rank() + 1) / comm->size() : params.batch_size;
+}
+
+
+// Общий цикл обучения с шага start_step. nextBatch(micro, batch) заполняет batch микробатчем номер micro
+// от начала обучения; generator, если задан, — источник этих батчей, его заполненность выводится в лог.
+// Батч и вся рабочая память сети выделяются один раз до цикла, сам шаг память не выделяет.
+// При start_step > 0 оптимизатор модели не пересоздаётся: его состояние восстановлено resumeTraining.
+// С comm процесс считает только свою часть микробатча (nextBatch заполняет строки rankRowsBegin ...),
+// градиенты и потери суммируются по всем процессам, и каждый делает одинаковый шаг оптимизатора.
+// Лог, чекпоинты и промежуточные рендеры — только у rank 0
+template <class NextBatch>
+void trainLoop(
+    SIREN& model,
     const TrainParams& params,
-    const std::string& cameraFile, 
-    const std::string& lightFile
+    const std::string& cameraFile,
+    const std::string& lightFile,
+    NextBatch&& nextBatch,
+    const SampleGenerator* generator,
+    int start_step,
+    AllReduce* comm
 ) {
-    int N = data.x.rows;
-    auto mse = MSE();
     float running_loss = 0.0f;
     float running_time = 0.0f;
-    model.setLR(params.lr);
+    if (start_step == 0) {
+        model.setOptimizer(makeOptimizer(params));
+    }
+    bool main_rank = !comm || comm->rank() == 0;
 
-    for (int i = 0; i < params.num_steps; ++i) {
-        auto start = std::chrono::high_resolution_clock::now();
+    // Чекпоинты и промежуточные рендеры делаются по снимку весов на фоновой нити, обучение их не ждёт
+    std::unique_ptr<BackgroundWorker> background;
+    if (params.background_threads > 0 && main_rank) {
+        background.reset(new BackgroundWorker(params.background_threads));
+    }
 
-        Data batch = getBatch(data, params.batch_size);
-        auto output = model.forward(batch.x);
-        auto loss = mse.forward(output, batch.y);
-        auto mse_grad = mse.backward();
-        auto model_grad = model.backward(mse_grad);
+    size_t rows = rankRowsEnd(params, comm) - rankRowsBegin(params, comm);
+    InferenceWorkspace ws;
+    model.reserve(rows, ws);
+    // При data_parallel > 1 микробатч делится на части, которые считаются параллельно (data_parallel.hpp)
+    std::unique_ptr<DataParallel> shards;
+    if (params.data_parallel > 1) {
+        shards.reset(new DataParallel(model, rows, params.data_parallel, params.batch_size));
+    }
+    Data batch = {Matrix(rows, model.inputWidth()), Matrix(rows, model.outputWidth())};
+    std::vector<float> micro_losses(params.grad_accum_steps);
+    uint64_t window_allocations = 0;
+    int window_steps = 0;
+
+    for (int i = start_step; i < params.num_steps; ++i) {
+        auto start = std::chrono::high_resolution_clock::now();
+        uint64_t allocations = heap_allocation_counter ? heap_allocation_counter->load() : 0;
+
+        // Градиенты grad_accum_steps микробатчей суммируются, усредняются и только потом применяются
+        model.zeroGrad();
+        for (int micro = 0; micro < params.grad_accum_steps; ++micro) {
+            nextBatch(uint64_t(i) * params.grad_accum_steps + micro, batch);
+            micro_losses[micro] = shards ? shards->accumulate(model, batch.x.data.data(), batch.y.data.data())
+                                         : model.trainStep(batch.x.data.data(), batch.y.data.data(), rows, ws,
+                                                           model.gradients(), params.batch_size);
+        }
+        if (shards) {
+            shards->reduce(model);
+        }
+        if (comm) {
+            comm->sum(model.gradients(), model.numParams());
+            comm->sum(micro_losses.data(), micro_losses.size());
+        }
+        float loss = 0.0f;
+        for (float micro_loss : micro_losses) {
+            loss = loss + micro_loss / params.grad_accum_steps;
+        }
+        if (params.grad_accum_steps > 1) {
+            model.scaleGrad(1.0f / params.grad_accum_steps);
+        }
+        if (params.grad_clip > 0.0f) {
+            model.clipGradNorm(params.grad_clip);
+        }
+        model.step();
+        if (heap_allocation_counter) {
+            window_allocations += heap_allocation_counter->load() - allocations;
+            ++window_steps;
+        }
 
         auto end = std::chrono::high_resolution_clock::now();
         std::chrono::duration<double, std::milli> elapsed = end - start;
 
-        if (i == 0) {
+        if (i == start_step) {
             running_time = elapsed.count();
         } else {
             running_time = running_time * 0.99 + 0.01 * elapsed.count();
         }
 
-        if (i == 0) {
-            running_loss = loss(0, 0);
+        if (i == start_step) {
+            running_loss = loss;
         } else {
-            running_loss = running_loss * 0.9 + loss(0, 0) * 0.1;
+            running_loss = running_loss * 0.9 + loss * 0.1;
+        }
+
+        if (!main_rank) {
+            continue;
         }
 
         if ((i + 1) % params.log_iter == 0) {
-            std::cout << "Iter: " << i + 1 << ", Loss: " << loss(0, 0) << ", Steps per second: " << 1000.0f / running_time << std::endl;
+            std::cout << "Iter: " << i + 1 << ", Loss: " << loss << ", Steps per second: " << 1000.0f / running_time;
+            if (generator) {
+                std::cout << ", Queue: " << generator->depth() << "/" << generator->capacity()
+                          << ", Samples per second: " << generator->throughput()
+                          << ", Stall: " << generator->stallSeconds() << " s";
+            }
+            if (heap_allocation_counter) {
+                std::cout << ", Allocations per step: " << double(window_allocations) / window_steps;
+                window_allocations = 0;
+                window_steps = 0;
+            }
+            std::cout << std::endl;
         }
 
         if ((i + 1) % params.checkpoint_iter == 0) {
             std::ostringstream ckptPath;
             ckptPath << "train_results/weights/ckpt" << i + 1 << ".bin";
-            model.saveWeights(ckptPath.str());
-            std::cout << "Saved checkpoint to " << ckptPath.str() << std::endl;
+            std::string path = ckptPath.str();
+            TrainState state = {uint64_t(i + 1), params.seed};
+            if (background) {
+                auto snapshot = std::make_shared<WeightsSnapshot>(checkpointSnapshot(model, state));
+                background->submit([snapshot, path] {
+                    snapshot->write(path);
+                    std::cout << "Saved checkpoint to " << path << std::endl;
+                });
+            } else {
+                saveCheckpoint(model, state, path);
+                std::cout << "Saved checkpoint to " << path << std::endl;
+            }
         }
 
         if ((i + 1) % params.render_iter == 0) {
             std::ostringstream ckptPath;
             ckptPath << "train_results/renders/step" << i + 1 << ".png";
-            Mesh mesh;
-            render(model, cameraFile, lightFile, ckptPath.str(), 128);
+            std::string path = ckptPath.str();
+            if (background) {
+                std::shared_ptr<SIREN> snapshot(model.snapshot());
+                background->submit([snapshot, cameraFile, lightFile, path] {
+                    render(*snapshot, cameraFile, lightFile, path, 128);
+                });
+            } else {
+                render(model, cameraFile, lightFile, path, 128);
+            }
         }
     }
-}
\ No newline at end of file
+}
+
+
+// Обучение на фиксированном наборе точек
+void train(
+    SIREN& model, 
+    Data& data,
+    const TrainParams& params,
+    const std::string& cameraFile, 
+    const std::string& lightFile,
+    int start_step = 0,
+    AllReduce* comm = nullptr
+) {
+    size_t skip = rankRowsBegin(params, comm);
+    trainLoop(model, params, cameraFile, lightFile, [&](uint64_t micro, Data& batch) {
+        // Поток зависит только от номера микробатча, поэтому с шага i обучение можно повторить
+        RandomStream rng(params.seed, randomStream(RandomPurpose::Batch, micro));
+        getBatch(data, rng, batch, skip);
+    }, nullptr, start_step, comm);
+}
+
+
+// Обучение на свежих точках из фоновой генерации: каждый микробатч — новые точки меша.
+// При продолжении генерация должна начинаться с батча start_step * grad_accum_steps,
+// с comm — генерировать только строки rankRowsBegin ... rankRowsEnd
+void train(
+    SIREN& model,
+    SampleGenerator& generator,
+    const TrainParams& params,
+    const std::string& cameraFile,
+    const std::string& lightFile,
+    int start_step = 0,
+    AllReduce* comm = nullptr
+) {
+    trainLoop(model, params, cameraFile, lightFile, [&](uint64_t, Data& batch) {
+        generator.next(batch);
+    }, &generator, start_step, comm);
+}
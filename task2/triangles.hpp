@@ -0,0 +1,324 @@
+#pragma once
+#include "matrix.hpp"
+#include "bvh.hpp"
+#include <glm/glm.hpp>
+#include <vector>
+#include <cstdlib>
+#include <string>
+#include <limits>
+
+
+// Предвычисленные поля треугольника в блоке (структура массивов, по lanes значений на поле):
+// первая вершина, три ребра, нормали к рёбрам в плоскости треугольника (cross(e, n)), нормаль,
+// обратные квадраты длин рёбер и нормали. Вторая и третья вершины восстанавливаются по рёбрам
+enum TriangleField {
+    TRI_V1X, TRI_V1Y, TRI_V1Z,
+    TRI_E21X, TRI_E21Y, TRI_E21Z,
+    TRI_E32X, TRI_E32Y, TRI_E32Z,
+    TRI_E13X, TRI_E13Y, TRI_E13Z,
+    TRI_C21X, TRI_C21Y, TRI_C21Z,
+    TRI_C32X, TRI_C32Y, TRI_C32Z,
+    TRI_C13X, TRI_C13Y, TRI_C13Z,
+    TRI_NX, TRI_NY, TRI_NZ,
+    TRI_INV21, TRI_INV32, TRI_INV13, TRI_INVN,
+    TRI_FIELDS
+};
+
+// Пустые слоты блока: вырожденный треугольник так далеко, что никогда не станет ближайшим
+const float TRI_PAD_COORD = 1e18f;
+
+
+// Вектор из W float (векторное расширение GCC): арифметика и сравнения над ним — одна
+// инструкция на все линии, ширина регистра определяется target у обёртки ядра
+template <int W>
+struct TriangleLanes {
+    typedef float Vec __attribute__((vector_size(W * sizeof(float))));
+    typedef int IntVec __attribute__((vector_size(W * sizeof(int))));
+};
+
+
+// Квадрат расстояния от точки до всех треугольников блоков, по треугольнику на линию вектора.
+// Та же формула, что и в Triangle::distance2, но без ветвлений: выбор ребро/грань, clamp и знаки
+// делаются масками. Автовекторизация цикла по линиям GCC здесь не удаётся, поэтому вектор явный
+template <int W>
+__attribute__((always_inline))
+inline float blockDistance2Body(const float* blocks, size_t num_blocks, float px, float py, float pz) {
+    typedef typename TriangleLanes<W>::Vec V;
+    const V zero = {}, one = zero + 1.0f;
+    V best = zero + std::numeric_limits<float>::max();
+
+    for (size_t b = 0; b < num_blocks; ++b) {
+        const V* t = reinterpret_cast<const V*>(blocks + b * TRI_FIELDS * W);
+        V p1x = px - t[TRI_V1X], p1y = py - t[TRI_V1Y], p1z = pz - t[TRI_V1Z];
+        V e21x = t[TRI_E21X], e21y = t[TRI_E21Y], e21z = t[TRI_E21Z];
+        V e32x = t[TRI_E32X], e32y = t[TRI_E32Y], e32z = t[TRI_E32Z];
+        V e13x = t[TRI_E13X], e13y = t[TRI_E13Y], e13z = t[TRI_E13Z];
+        V p2x = p1x - e21x, p2y = p1y - e21y, p2z = p1z - e21z;
+        V p3x = p2x - e32x, p3y = p2y - e32y, p3z = p2z - e32z;
+
+        V s1 = t[TRI_C21X] * p1x + t[TRI_C21Y] * p1y + t[TRI_C21Z] * p1z;
+        V s2 = t[TRI_C32X] * p2x + t[TRI_C32Y] * p2y + t[TRI_C32Z] * p2z;
+        V s3 = t[TRI_C13X] * p3x + t[TRI_C13Y] * p3y + t[TRI_C13Z] * p3z;
+        V signs = ((s1 > 0.0f) ? one : zero) - ((s1 < 0.0f) ? one : zero) +
+                  ((s2 > 0.0f) ? one : zero) - ((s2 < 0.0f) ? one : zero) +
+                  ((s3 > 0.0f) ? one : zero) - ((s3 < 0.0f) ? one : zero);
+
+        V k1 = (e21x * p1x + e21y * p1y + e21z * p1z) * t[TRI_INV21];
+        V k2 = (e32x * p2x + e32y * p2y + e32z * p2z) * t[TRI_INV32];
+        V k3 = (e13x * p3x + e13y * p3y + e13z * p3z) * t[TRI_INV13];
+        k1 = k1 < 0.0f ? zero : (k1 > 1.0f ? one : k1);
+        k2 = k2 < 0.0f ? zero : (k2 > 1.0f ? one : k2);
+        k3 = k3 < 0.0f ? zero : (k3 > 1.0f ? one : k3);
+        V d1x = e21x * k1 - p1x, d1y = e21y * k1 - p1y, d1z = e21z * k1 - p1z;
+        V d2x = e32x * k2 - p2x, d2y = e32y * k2 - p2y, d2z = e32z * k2 - p2z;
+        V d3x = e13x * k3 - p3x, d3y = e13y * k3 - p3y, d3z = e13z * k3 - p3z;
+        V edge1 = d1x * d1x + d1y * d1y + d1z * d1z;
+        V edge2 = d2x * d2x + d2y * d2y + d2z * d2z;
+        V edge3 = d3x * d3x + d3y * d3y + d3z * d3z;
+        V edges = edge2 < edge1 ? edge2 : edge1;
+        edges = edge3 < edges ? edge3 : edges;
+
+        V np = t[TRI_NX] * p1x + t[TRI_NY] * p1y + t[TRI_NZ] * p1z;
+        V face = np * np * t[TRI_INVN];
+
+        V d2 = signs < 2.0f ? edges : face;
+        best = d2 < best ? d2 : best;
+    }
+
+    float result = best[0];
+    for (int l = 1; l < W; ++l) {
+        result = std::min(result, best[l]);
+    }
+    return result;
+}
+
+
+// Быстрый обратный корень по битам и три итерации Ньютона: относительная ошибка ~1e-7.
+// В векторных расширениях нет sqrt, а интринсики привязали бы тело ядра к одному набору инструкций.
+// Векторы передаются по ссылке: по значению их ABI зависит от target вызывающей функции
+template <class V, class VI>
+__attribute__((always_inline))
+inline void lanesSqrt(const V& x, V& result) {
+    // Приведение между векторами одного размера переинтерпретирует биты
+    VI i = 0x5f3759df - ((VI)x >> 1);
+    V y = (V)i;
+    for (int k = 0; k < 3; ++k) {
+        y = y * (1.5f - 0.5f * x * y * y);
+    }
+    result = x * y;
+}
+
+// atan2 по полиному Cephes для atanf на [0, tan(pi/8)] с редукцией аргумента, ошибка ~1e-7
+template <class V>
+__attribute__((always_inline))
+inline void lanesAtan2(const V& y, const V& x, V& result) {
+    const float PI = 3.14159265358979f;
+    const V zero = {};
+    V ax = x < 0.0f ? -x : x, ay = y < 0.0f ? -y : y;
+    V mx = ax > ay ? ax : ay, mn = ax > ay ? ay : ax;
+    V t = mx > 0.0f ? mn / (mx > 0.0f ? mx : zero + 1.0f) : zero;
+
+    V big = t > 0.4142135623730950f ? zero + 1.0f : zero;
+    t = big > 0.0f ? (t - 1.0f) / (t + 1.0f) : t;
+    V z = t * t;
+    V r = (((8.05374449538e-2f * z - 1.38776856032e-1f) * z + 1.99777106478e-1f) * z - 3.33329491539e-1f) * z * t + t;
+    r = r + big * (PI / 4.0f);
+
+    r = ay > ax ? PI / 2.0f - r : r;
+    r = x < 0.0f ? PI - r : r;
+    result = y < 0.0f ? -r : r;
+}
+
+// Сумма телесных углов треугольников блоков, видимых из точки (формула Van Oosterom, Strackee,
+// как в solidAngle из winding.hpp). Определитель det(a, b, c) равен (p - v1) . n, поэтому
+// у пустых слотов с нулевой нормалью он точно 0 и они ничего не добавляют
+template <int W>
+__attribute__((always_inline))
+inline float blockSolidAngleBody(const float* blocks, size_t num_blocks, float px, float py, float pz) {
+    typedef typename TriangleLanes<W>::Vec V;
+    typedef typename TriangleLanes<W>::IntVec VI;
+    V sum = {};
+
+    for (size_t b = 0; b < num_blocks; ++b) {
+        const V* t = reinterpret_cast<const V*>(blocks + b * TRI_FIELDS * W);
+        V ax = t[TRI_V1X] - px, ay = t[TRI_V1Y] - py, az = t[TRI_V1Z] - pz;
+        V bx = ax + t[TRI_E21X], by = ay + t[TRI_E21Y], bz = az + t[TRI_E21Z];
+        V cx = bx + t[TRI_E32X], cy = by + t[TRI_E32Y], cz = bz + t[TRI_E32Z];
+
+        V la, lb, lc, angle;
+        lanesSqrt<V, VI>(ax * ax + ay * ay + az * az, la);
+        lanesSqrt<V, VI>(bx * bx + by * by + bz * bz, lb);
+        lanesSqrt<V, VI>(cx * cx + cy * cy + cz * cz, lc);
+        V det = -(ax * t[TRI_NX] + ay * t[TRI_NY] + az * t[TRI_NZ]);
+        V denom = la * lb * lc + (ax * bx + ay * by + az * bz) * lc + (bx * cx + by * cy + bz * cz) * la +
+                  (cx * ax + cy * ay + cz * az) * lb;
+        lanesAtan2(det, denom, angle);
+        sum += angle;
+    }
+
+    float result = 0.0f;
+    for (int l = 0; l < W; ++l) {
+        result += sum[l];
+    }
+    return 2.0f * result;
+}
+
+
+typedef float (*BlockDistance2)(const float* blocks, size_t num_blocks, float px, float py, float pz);
+typedef float (*BlockSolidAngle)(const float* blocks, size_t num_blocks, float px, float py, float pz);
+
+inline float blockDistance2Scalar(const float* blocks, size_t num_blocks, float px, float py, float pz) {
+    return blockDistance2Body<4>(blocks, num_blocks, px, py, pz);
+}
+
+inline float blockSolidAngleScalar(const float* blocks, size_t num_blocks, float px, float py, float pz) {
+    return blockSolidAngleBody<4>(blocks, num_blocks, px, py, pz);
+}
+
+__attribute__((target("avx2,fma")))
+inline float blockDistance2Avx2(const float* blocks, size_t num_blocks, float px, float py, float pz) {
+    return blockDistance2Body<8>(blocks, num_blocks, px, py, pz);
+}
+
+__attribute__((target("avx2,fma")))
+inline float blockSolidAngleAvx2(const float* blocks, size_t num_blocks, float px, float py, float pz) {
+    return blockSolidAngleBody<8>(blocks, num_blocks, px, py, pz);
+}
+
+__attribute__((target("avx512f")))
+inline float blockDistance2Avx512(const float* blocks, size_t num_blocks, float px, float py, float pz) {
+    return blockDistance2Body<16>(blocks, num_blocks, px, py, pz);
+}
+
+__attribute__((target("avx512f")))
+inline float blockSolidAngleAvx512(const float* blocks, size_t num_blocks, float px, float py, float pz) {
+    return blockSolidAngleBody<16>(blocks, num_blocks, px, py, pz);
+}
+
+
+struct TriangleKernel {
+    const char* name;
+    size_t lanes;
+    BlockDistance2 fn;
+    BlockSolidAngle solid_angle;
+};
+
+inline TriangleKernel selectTriangleKernel() {
+    const TriangleKernel scalar = {"scalar", 4, blockDistance2Scalar, blockSolidAngleScalar};
+    const TriangleKernel avx2 = {"avx2", 8, blockDistance2Avx2, blockSolidAngleAvx2};
+    const TriangleKernel avx512 = {"avx512", 16, blockDistance2Avx512, blockSolidAngleAvx512};
+
+    __builtin_cpu_init();
+    bool hasAvx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    bool hasAvx512 = __builtin_cpu_supports("avx512f");
+
+    // SIREN_MESH_KERNEL=scalar|avx2|avx512 — то же, что SIREN_GEMM_KERNEL для умножения матриц
+    const char* forced = std::getenv("SIREN_MESH_KERNEL");
+    if (forced) {
+        std::string name(forced);
+        if (name == "scalar") return scalar;
+        if (name == "avx2" && hasAvx2) return avx2;
+        if (name == "avx512" && hasAvx512) return avx512;
+    }
+    if (hasAvx512) return avx512;
+    if (hasAvx2) return avx2;
+    return scalar;
+}
+
+inline const TriangleKernel& triangleKernel() {
+    static const TriangleKernel k = selectTriangleKernel();
+    return k;
+}
+
+
+// Треугольники меша в блоках по lanes штук. Каждый лист BVH занимает целое число блоков
+// (хвост добивается пустыми слотами), так что ядро всегда работает полными векторами
+class TriangleBlocks {
+public:
+    size_t lanes;
+    AlignedBuffer data;
+    // По индексу узла BVH: первый блок листа и число блоков
+    std::vector<uint32_t> leaf_first, leaf_count;
+
+    TriangleBlocks() : lanes(0) {}
+
+    // Треугольники должны лежать в порядке листьев bvh
+    template <class Tri>
+    void build(const BVH& bvh, const std::vector<Tri>& triangles) {
+        lanes = triangleKernel().lanes;
+        leaf_first.assign(bvh.nodes.size(), 0);
+        leaf_count.assign(bvh.nodes.size(), 0);
+
+        size_t num_blocks = 0;
+        for (size_t n = 0; n < bvh.nodes.size(); ++n) {
+            if (bvh.nodes[n].count > 0) {
+                leaf_first[n] = num_blocks;
+                leaf_count[n] = (bvh.nodes[n].count + lanes - 1) / lanes;
+                num_blocks += leaf_count[n];
+            }
+        }
+
+        data.resize(num_blocks * TRI_FIELDS * lanes);
+        for (size_t n = 0; n < bvh.nodes.size(); ++n) {
+            const BVHNode& nd = bvh.nodes[n];
+            for (uint32_t slot = 0; slot < leaf_count[n] * lanes; ++slot) {
+                float* block = data.data() + (leaf_first[n] + slot / lanes) * TRI_FIELDS * lanes;
+                if (slot < nd.count) {
+                    const Tri& t = triangles[nd.first + slot];
+                    store(block, slot % lanes, t.v1, t.v2, t.v3);
+                } else {
+                    glm::vec3 pad(TRI_PAD_COORD);
+                    store(block, slot % lanes, pad, pad, pad);
+                }
+            }
+        }
+    }
+
+    size_t numBlocks() const {
+        return lanes == 0 ? 0 : data.size() / (TRI_FIELDS * lanes);
+    }
+
+    // Квадрат расстояния до ближайшего треугольника листа BVH
+    float leafDistance2(uint32_t node, const glm::vec3& p) const {
+        const float* blocks = data.data() + leaf_first[node] * TRI_FIELDS * lanes;
+        return triangleKernel().fn(blocks, leaf_count[node], p.x, p.y, p.z);
+    }
+
+    // Сумма телесных углов треугольников листа BVH (ближнее поле числа обмотки)
+    float leafSolidAngle(uint32_t node, const glm::vec3& p) const {
+        const float* blocks = data.data() + leaf_first[node] * TRI_FIELDS * lanes;
+        return triangleKernel().solid_angle(blocks, leaf_count[node], p.x, p.y, p.z);
+    }
+
+    // Полный перебор всех треугольников, без дерева
+    float distance2(const glm::vec3& p) const {
+        return triangleKernel().fn(data.data(), numBlocks(), p.x, p.y, p.z);
+    }
+
+private:
+    void store(float* block, size_t lane, const glm::vec3& v1, const glm::vec3& v2, const glm::vec3& v3) {
+        glm::vec3 e21 = v2 - v1, e32 = v3 - v2, e13 = v1 - v3;
+        glm::vec3 nor = glm::cross(e21, e13);
+        glm::vec3 c21 = glm::cross(e21, nor), c32 = glm::cross(e32, nor), c13 = glm::cross(e13, nor);
+        float fields[TRI_FIELDS] = {
+            v1.x, v1.y, v1.z,
+            e21.x, e21.y, e21.z,
+            e32.x, e32.y, e32.z,
+            e13.x, e13.y, e13.z,
+            c21.x, c21.y, c21.z,
+            c32.x, c32.y, c32.z,
+            c13.x, c13.y, c13.z,
+            nor.x, nor.y, nor.z,
+            reciprocal(glm::dot(e21, e21)), reciprocal(glm::dot(e32, e32)),
+            reciprocal(glm::dot(e13, e13)), reciprocal(glm::dot(nor, nor))
+        };
+        for (int f = 0; f < TRI_FIELDS; ++f) {
+            block[f * lanes + lane] = fields[f];
+        }
+    }
+
+    // У вырожденного ребра проекция на него — его начало, а не 0/0
+    static float reciprocal(float x) {
+        return x > 0.0f ? 1.0f / x : 0.0f;
+    }
+};
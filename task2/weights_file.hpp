@@ -0,0 +1,239 @@
+#pragma once
+#include "mapped_file.hpp"
+#include "hash.hpp"
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <memory>
+
+
+// Формат весов v2 (числа little-endian):
+//   WeightsHeader, 64 байта
+//   текст архитектуры (как в arch.txt), arch_size байт
+//   таблица из num_tensors записей WeightsTensor — с ближайшего кратного 64 смещения
+//   данные тензоров float, каждый с кратного 64 смещения
+// checksum — weightsChecksum всех байт файла после заголовка. Смещения кратны 64, поэтому при отображении
+// файла в память тензоры сразу выровнены как AlignedBuffer, и по ним можно считать без копирования.
+// Старый формат — только параметры подряд без заголовка — по-прежнему читается (SIREN::loadWeights)
+const char WEIGHTS_MAGIC[8] = {'S', 'I', 'R', 'E', 'N', 'W', 'T', 'S'};
+const uint32_t WEIGHTS_VERSION = 2;
+const size_t WEIGHTS_ALIGN = 64;
+
+
+struct WeightsHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_tensors;
+    uint64_t arch_size;
+    uint64_t table_offset;
+    uint64_t file_size;
+    uint64_t checksum;
+    uint8_t reserved[16];
+};
+static_assert(sizeof(WeightsHeader) == 64, "заголовок весов должен занимать 64 байта");
+
+
+// Имя дополняется нулями, count — число float
+struct WeightsTensor {
+    char name[16];
+    uint64_t offset;
+    uint64_t count;
+};
+static_assert(sizeof(WeightsTensor) == 32, "запись таблицы тензоров должна занимать 32 байта");
+
+
+inline uint64_t alignWeights(uint64_t offset) {
+    return (offset + WEIGHTS_ALIGN - 1) / WEIGHTS_ALIGN * WEIGHTS_ALIGN;
+}
+
+
+inline bool isWeightsV2(const char* data, size_t size) {
+    return size >= sizeof(WeightsHeader) && std::memcmp(data, WEIGHTS_MAGIC, sizeof(WEIGHTS_MAGIC)) == 0;
+}
+
+
+// Читает только заголовок: формат можно узнать, не загружая файл
+inline bool isWeightsV2File(const std::string& filename) {
+    char head[sizeof(WeightsHeader)];
+    std::ifstream file(filename, std::ios::binary);
+    file.read(head, sizeof(head));
+    return isWeightsV2(head, static_cast<size_t>(file.gcount()));
+}
+
+
+// FNV-1a по 64-битным словам в четырёх независимых цепочках, чтобы умножения не ждали друг друга
+// (побайтный FNV-1a по мегабайту весов заметно дольше самой загрузки); хвост короче 32 байт — побайтно
+inline uint64_t weightsChecksum(const char* data, size_t size) {
+    const uint64_t PRIME = 1099511628211ull;
+    uint64_t h[4];
+    for (int k = 0; k < 4; ++k) {
+        h[k] = fnv1a(&k, sizeof(k));
+    }
+    size_t blocks = size / sizeof(h);
+    for (size_t i = 0; i < blocks; ++i) {
+        uint64_t w[4];
+        std::memcpy(w, data + i * sizeof(w), sizeof(w));
+        for (int k = 0; k < 4; ++k) {
+            h[k] = (h[k] ^ w[k]) * PRIME;
+        }
+    }
+    return fnv1a(data + blocks * sizeof(h), size - blocks * sizeof(h), fnv1a(h, sizeof(h)));
+}
+
+
+// Тензор для записи: данные не копируются, поэтому должны жить до конца writeWeightsFile
+struct WeightsTensorData {
+    std::string name;
+    const float* data;
+    size_t count;
+};
+
+
+// Файл собирается целиком в памяти и пишется во временный файл, который затем переименовывается:
+// читатель, отобразивший старую версию файла, продолжает видеть её, а не обрезанный файл
+inline void writeWeightsFile(const std::string& filename, const std::string& arch,
+                             const std::vector<WeightsTensorData>& tensors) {
+    WeightsHeader header = {};
+    std::memcpy(header.magic, WEIGHTS_MAGIC, sizeof(WEIGHTS_MAGIC));
+    header.version = WEIGHTS_VERSION;
+    header.num_tensors = tensors.size();
+    header.arch_size = arch.size();
+    header.table_offset = alignWeights(sizeof(WeightsHeader) + arch.size());
+
+    std::vector<WeightsTensor> table(tensors.size());
+    uint64_t offset = alignWeights(header.table_offset + table.size() * sizeof(WeightsTensor));
+    for (size_t i = 0; i < tensors.size(); ++i) {
+        if (tensors[i].name.size() >= sizeof(table[i].name)) {
+            throw std::runtime_error("Слишком длинное имя тензора: " + tensors[i].name);
+        }
+        std::memset(table[i].name, 0, sizeof(table[i].name));
+        std::memcpy(table[i].name, tensors[i].name.data(), tensors[i].name.size());
+        table[i].offset = offset;
+        table[i].count = tensors[i].count;
+        offset = alignWeights(offset + tensors[i].count * sizeof(float));
+    }
+    header.file_size = offset;
+
+    std::vector<char> bytes(header.file_size, 0);
+    std::memcpy(bytes.data() + sizeof(WeightsHeader), arch.data(), arch.size());
+    std::memcpy(bytes.data() + header.table_offset, table.data(), table.size() * sizeof(WeightsTensor));
+    for (size_t i = 0; i < tensors.size(); ++i) {
+        std::memcpy(bytes.data() + table[i].offset, tensors[i].data, tensors[i].count * sizeof(float));
+    }
+    header.checksum = weightsChecksum(bytes.data() + sizeof(WeightsHeader), bytes.size() - sizeof(WeightsHeader));
+    std::memcpy(bytes.data(), &header, sizeof(header));
+
+    std::string tmp = filename + ".tmp";
+    {
+        std::ofstream file(tmp, std::ios::binary);
+        if (!file) {
+            throw std::runtime_error("Не удалось открыть файл для записи весов: " + tmp);
+        }
+        file.write(bytes.data(), bytes.size());
+        if (!file) {
+            throw std::runtime_error("Ошибка записи весов в файл: " + tmp);
+        }
+    }
+    if (std::rename(tmp.c_str(), filename.c_str()) != 0) {
+        throw std::runtime_error("Не удалось переименовать " + tmp + " в " + filename);
+    }
+}
+
+
+// Копия тензоров на момент создания: запись в файл откладывается, а оригиналы тем временем меняются
+class WeightsSnapshot {
+public:
+    WeightsSnapshot(const std::string& arch, const std::vector<WeightsTensorData>& tensors) : arch(arch) {
+        for (const WeightsTensorData& t : tensors) {
+            names.push_back(t.name);
+            data.emplace_back(t.data, t.data + t.count);
+        }
+    }
+
+    void write(const std::string& filename) const {
+        std::vector<WeightsTensorData> tensors;
+        for (size_t i = 0; i < names.size(); ++i) {
+            tensors.push_back({names[i], data[i].data(), data[i].size()});
+        }
+        writeWeightsFile(filename, arch, tensors);
+    }
+
+private:
+    std::string arch;
+    std::vector<std::string> names;
+    std::vector<std::vector<float>> data;
+};
+
+
+// Отображённый в память файл v2 с проверенными заголовком, смещениями и контрольной суммой.
+// При writable = true отображение copy-on-write: тензоры можно менять на месте (например, обучать
+// загруженные веса), файл при этом не меняется, а нетронутые страницы остаются общими с кэшем ОС
+class WeightsFile {
+public:
+    WeightsFile(const std::string& filename, bool writable = false) : file(filename, writable) {
+        if (!isWeightsV2(file.data(), file.size())) {
+            throw std::runtime_error("Файл не в формате весов v2: " + filename);
+        }
+        std::memcpy(&header, file.data(), sizeof(header));
+        if (header.version != WEIGHTS_VERSION) {
+            throw std::runtime_error("Неподдерживаемая версия файла весов " + filename + ": " +
+                                     std::to_string(header.version));
+        }
+        if (header.file_size != file.size() || header.arch_size > file.size() ||
+            header.table_offset < sizeof(WeightsHeader) + header.arch_size ||
+            header.table_offset > file.size() ||
+            header.num_tensors > (file.size() - header.table_offset) / sizeof(WeightsTensor)) {
+            throw std::runtime_error("Файл весов повреждён или обрезан: " + filename);
+        }
+        uint64_t checksum = weightsChecksum(file.data() + sizeof(WeightsHeader), file.size() - sizeof(WeightsHeader));
+        if (checksum != header.checksum) {
+            throw std::runtime_error("Контрольная сумма файла весов не совпадает: " + filename);
+        }
+
+        table.resize(header.num_tensors);
+        std::memcpy(table.data(), file.data() + header.table_offset, table.size() * sizeof(WeightsTensor));
+        for (const WeightsTensor& t : table) {
+            if (t.offset % WEIGHTS_ALIGN != 0 || t.offset > file.size() ||
+                t.count > (file.size() - t.offset) / sizeof(float)) {
+                throw std::runtime_error("Файл весов повреждён: тензор " + tensorName(t) + " вне файла " + filename);
+            }
+        }
+    }
+
+    size_t numTensors() const {
+        return table.size();
+    }
+
+    std::string arch() const {
+        return std::string(file.data() + sizeof(WeightsHeader), header.arch_size);
+    }
+
+    // nullptr, если тензора нет; count получает число float
+    const float* tensor(const std::string& name, size_t& count) const {
+        for (const WeightsTensor& t : table) {
+            if (tensorName(t) == name) {
+                count = t.count;
+                return reinterpret_cast<const float*>(file.data() + t.offset);
+            }
+        }
+        count = 0;
+        return nullptr;
+    }
+
+    float* tensor(const std::string& name, size_t& count) {
+        return const_cast<float*>(static_cast<const WeightsFile&>(*this).tensor(name, count));
+    }
+
+private:
+    MappedFile file;
+    WeightsHeader header;
+    std::vector<WeightsTensor> table;
+
+    static std::string tensorName(const WeightsTensor& t) {
+        return std::string(t.name, strnlen(t.name, sizeof(t.name)));
+    }
+};
@@ -0,0 +1,134 @@
+#pragma once
+#include "bvh.hpp"
+#include <glm/glm.hpp>
+#include <vector>
+#include <cmath>
+
+
+const float FOUR_PI = 12.566370614359172f;
+
+
+// Телесный угол треугольника abc, видимого из начала координат (Van Oosterom, Strackee).
+// Положителен, если из точки треугольник виден обходом против часовой стрелки
+inline float solidAngle(const glm::vec3& a, const glm::vec3& b, const glm::vec3& c) {
+    float la = glm::length(a), lb = glm::length(b), lc = glm::length(c);
+    float det = glm::dot(a, glm::cross(b, c));
+    float denom = la * lb * lc + glm::dot(a, b) * lc + glm::dot(b, c) * la + glm::dot(c, a) * lb;
+    return 2.0f * std::atan2(det, denom);
+}
+
+
+// Кластер треугольников узла BVH для дальнего поля: центр (взвешенный по площади),
+// радиус шара с центром в center, содержащего все вершины, и сумма векторных площадей
+struct WindingNode {
+    glm::vec3 center;
+    float radius;
+    glm::vec3 normal;
+    float pad;
+};
+
+
+// Обобщённое число обмотки (Barill et al., "Fast Winding Numbers for Soups and Clouds"):
+// w(p) = сумма телесных углов треугольников / 4pi. Для замкнутого меша 1 внутри и 0 снаружи,
+// для дыр и самопересечений плавно переходит между ними. Далёкий кластер заменяется
+// диполем: w ~ (center - p) . normal / (4pi |center - p|^3), если |center - p| > beta * radius.
+// Работает поверх BVH меша, треугольники должны лежать в порядке листьев (bvh.order)
+class WindingNumber {
+public:
+    std::vector<WindingNode> nodes;
+    float beta;
+
+    WindingNumber(float beta = 2.0f) : beta(beta) {}
+
+    template <class Tri>
+    void build(const BVH& bvh, const std::vector<Tri>& triangles) {
+        nodes.assign(bvh.nodes.size(), WindingNode());
+        if (!bvh.empty()) {
+            buildNode(bvh, triangles, 0);
+        }
+    }
+
+    // leaf(node) возвращает сумму телесных углов треугольников листа nodes[node]
+    template <class LeafFn>
+    float evaluate(const BVH& bvh, const glm::vec3& p, LeafFn&& leaf) const {
+        if (bvh.empty()) {
+            return 0.0f;
+        }
+
+        uint32_t stack[BVH_MAX_DEPTH + 4];
+        int sp = 0;
+        stack[sp++] = 0;
+        float w = 0.0f;
+        while (sp > 0) {
+            uint32_t node = stack[--sp];
+            const WindingNode& wn = nodes[node];
+            glm::vec3 d = wn.center - p;
+            float dist2 = glm::dot(d, d);
+            if (dist2 > beta * beta * wn.radius * wn.radius) {
+                w += glm::dot(d, wn.normal) / (dist2 * std::sqrt(dist2));
+                continue;
+            }
+
+            const BVHNode& nd = bvh.nodes[node];
+            if (nd.count > 0) {
+                w += leaf(node);
+            } else {
+                stack[sp++] = nd.first;
+                stack[sp++] = node + 1;
+            }
+        }
+        return w / FOUR_PI;
+    }
+
+    // То же с точным телесным углом каждого треугольника листа по одному
+    template <class Tri>
+    float evaluate(const BVH& bvh, const std::vector<Tri>& triangles, const glm::vec3& p) const {
+        return evaluate(bvh, p, [&](uint32_t node) {
+            const BVHNode& nd = bvh.nodes[node];
+            float w = 0.0f;
+            for (uint32_t i = nd.first; i < nd.first + nd.count; ++i) {
+                const Tri& t = triangles[i];
+                w += solidAngle(t.v1 - p, t.v2 - p, t.v3 - p);
+            }
+            return w;
+        });
+    }
+
+private:
+    // Возвращает площадь кластера, чтобы родитель мог усреднить центры потомков
+    template <class Tri>
+    float buildNode(const BVH& bvh, const std::vector<Tri>& triangles, uint32_t node) {
+        const BVHNode& nd = bvh.nodes[node];
+        WindingNode& wn = nodes[node];
+        float area = 0.0f;
+        glm::vec3 center(0.0f), normal(0.0f);
+
+        if (nd.count > 0) {
+            for (uint32_t i = nd.first; i < nd.first + nd.count; ++i) {
+                const Tri& t = triangles[i];
+                glm::vec3 n = glm::cross(t.v2 - t.v1, t.v3 - t.v1) * 0.5f;
+                float a = glm::length(n);
+                normal += n;
+                center += (t.v1 + t.v2 + t.v3) * (a / 3.0f);
+                area += a;
+            }
+        } else {
+            uint32_t children[2] = {node + 1, nd.first};
+            for (uint32_t c : children) {
+                float a = buildNode(bvh, triangles, c);
+                normal += nodes[c].normal;
+                center += nodes[c].center * a;
+                area += a;
+            }
+        }
+        // Вырожденный кластер без площади: центр коробки
+        center = area > 0.0f ? center / area : (nd.lo + nd.hi) * 0.5f;
+
+        // Радиус по углам коробки узла — с запасом, зато без второго прохода по вершинам
+        glm::vec3 far = glm::max(glm::abs(nd.hi - center), glm::abs(center - nd.lo));
+        wn.center = center;
+        wn.radius = glm::length(far);
+        wn.normal = normal;
+        return area;
+    }
+};